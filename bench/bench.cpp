@@ -0,0 +1,213 @@
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "parser.hpp"
+#include "simulator.hpp"
+#include "sourcefile.hpp"
+#include "utilities.hpp"
+
+namespace {
+
+std::filesystem::path getBenchDirectory() {
+    auto path = std::filesystem::temp_directory_path() / "armcomp_bench";
+    std::filesystem::create_directories(path);
+    return path;
+}
+
+std::string writeProgram(const std::string& name, const std::string& contents) {
+    const auto path = (getBenchDirectory() / name).string();
+    std::ofstream file{path, std::ios::out | std::ios::trunc};
+    file << contents;
+    return path;
+}
+
+// Writes a program of roughly the given number of lines, made of small functions that are all called from the main code
+const std::string& getSyntheticProgram(int64_t lineCount) {
+    static std::map<int64_t, std::string> programs;
+    if (const auto found = programs.find(lineCount); found != programs.end())
+        return found->second;
+
+    // Each function is 10 lines, and calling it is another 2
+    std::ostringstream out;
+    const auto functionCount = std::max<int64_t>(lineCount / 12, 1);
+    for (int64_t i = 0; i < functionCount; i++) {
+        out << "func f" << i << " a b\n"
+            << "    let x = a * 3 + b\n"
+            << "    while x > 100\n"
+            << "        x = x / 2 - b\n"
+            << "    end\n"
+            << "    if x == 7\n"
+            << "        println \"seven\"\n"
+            << "    end\n"
+            << "    return x + a\n"
+            << "end\n";
+    }
+    out << "let t = 1\n";
+    for (int64_t i = 0; i < functionCount; i++)
+        out << "f" << i << " t 2\n"
+            << "t = _\n";
+    out << "exit t\n";
+    return programs[lineCount] = writeProgram("synthetic" + std::to_string(lineCount) + ".arm", out.str());
+}
+
+void applySizes(benchmark::internal::Benchmark* benchmark) {
+    benchmark->RangeMultiplier(8)->Range(1 << 10, 1 << 20)->Unit(benchmark::kMillisecond);
+}
+
+void BM_ReadFile(benchmark::State& state) {
+    const auto& path = getSyntheticProgram(state.range(0));
+    int64_t bytes = 0;
+    for (auto _ : state) {
+        SourceFile source{path};
+        const auto contents = source.getContents();
+        benchmark::DoNotOptimize(std::count(contents.begin(), contents.end(), '\n'));
+        bytes += static_cast<int64_t>(contents.size());
+    }
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_ReadFile)->Apply(applySizes);
+
+void BM_SplitString(benchmark::State& state) {
+    SourceFile source{getSyntheticProgram(state.range(0))};
+    const auto contents = source.getContents();
+    std::vector<std::string_view> lines;
+    splitString(contents, lines, '\n');
+    std::vector<std::string_view> tokens;
+    for (auto _ : state) {
+        tokens.clear();
+        for (const auto line : lines)
+            splitString(line, tokens);
+        benchmark::DoNotOptimize(tokens.data());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * lines.size()));
+}
+BENCHMARK(BM_SplitString)->Apply(applySizes);
+
+void BM_Parse(benchmark::State& state) {
+    const auto& path = getSyntheticProgram(state.range(0));
+    for (auto _ : state) {
+        Parser parser{path};
+        if (auto error = parser.parse(); !error.empty()) {
+            state.SkipWithError(error.c_str());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Parse)->Apply(applySizes);
+
+void BM_GetAssembly(benchmark::State& state) {
+    Parser parser{getSyntheticProgram(state.range(0))};
+    if (auto error = parser.parse(); !error.empty()) {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+    int64_t bytes = 0;
+    for (auto _ : state) {
+        const auto assembly = parser.getAssembly();
+        benchmark::DoNotOptimize(assembly.data());
+        bytes += static_cast<int64_t>(assembly.size());
+    }
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_GetAssembly)->Apply(applySizes);
+
+// Instructions are indented, labels and directives aren't
+int64_t countInstructions(std::string_view assembly) {
+    int64_t count = 0;
+    std::vector<std::string_view> lines;
+    splitString(assembly, lines, '\n');
+    for (const auto line : lines)
+        count += line.starts_with('\t');
+    return count;
+}
+
+// Compiles and runs a program, recording how big the generated code is and how many instructions it takes to run
+void benchmarkCorpusProgram(benchmark::State& state, const std::string& path) {
+    int64_t instructions = 0;
+    for (auto _ : state) {
+        Parser parser{path};
+        if (auto error = parser.parse(); !error.empty()) {
+            state.SkipWithError(error.c_str());
+            return;
+        }
+        instructions = countInstructions(parser.getCodeBlock()) + countInstructions(parser.getProcedureBlock());
+        benchmark::DoNotOptimize(parser.getAssembly().data());
+    }
+
+    Parser parser{path};
+    (void) parser.parse();
+    std::ostringstream output;
+    std::istringstream input;
+    Simulator simulator{output, input};
+    if (auto error = simulator.load(parser.getAssembly()); !error.empty()) {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+    if (auto error = simulator.run(); !error.empty()) {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+    state.counters["instructions"] = static_cast<double>(instructions);
+    state.counters["executed"] = static_cast<double>(simulator.getExecutedCount());
+    state.counters["exit_code"] = simulator.getExitCode();
+}
+
+// The code under "sample code" in the readme
+std::string getReadmeSample() {
+    std::ifstream file{ARMCOMP_SOURCE_DIR "/README.md"};
+    const std::string readme{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    const auto begin = readme.find("```fs\n");
+    if (begin == std::string::npos)
+        return "";
+    const auto end = readme.find("```", begin + 6);
+    return readme.substr(begin + 6, end - begin - 6);
+}
+
+void registerCorpus() {
+    const std::pair<std::string, std::string> corpus[] = {
+        {"readme", getReadmeSample()},
+        {"prime",
+            "let count = 0\n"
+            "let n = 2\n"
+            "while n < 200\n"
+            "    prime n\n"
+            "    count += _\n"
+            "    n += 1\n"
+            "end\n"
+            "exit count\n"},
+        {"gcd",
+            "let total = 0\n"
+            "let n = 1\n"
+            "while n < 50\n"
+            "    gcd 1071 n\n"
+            "    total += _\n"
+            "    n += 1\n"
+            "end\n"
+            "exit total\n"},
+    };
+    for (const auto& [name, source] : corpus) {
+        const auto path = writeProgram(name + ".arm", source);
+        benchmark::RegisterBenchmark(("BM_Corpus/" + name).c_str(), [path](benchmark::State& state) {
+            benchmarkCorpusProgram(state, path);
+        })->Unit(benchmark::kMicrosecond);
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    registerCorpus();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
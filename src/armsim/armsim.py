@@ -86,6 +86,7 @@ Currently supported:
     orr{s}  rd, rn, rm
     eor{s}  rd, rn, imm
     cmp     rn, rm
+    csel    rd, rn, rm, <cond> //rd = rn if cond holds, else rm. cond is eq, ne, lt, le, gt, ge, mi or pl
     cbnz    rn, <label>
     cbz     rn, <label>
     b       <label>
@@ -846,6 +847,16 @@ def execute(line:str):
         z_flag = True if reg[rn] == imm else False
         n_flag = True if reg[rn] < imm else False
         return
+    #csel rd, rn, rm, <cond>
+    if(re.match('csel {},{},{},(eq|ne|lt|le|gt|ge|mi|pl)$'.format(rg,rg,rg),line)):
+        rd = re.findall(rg,line)[0]
+        rn = re.findall(rg,line)[1]
+        rm = re.findall(rg,line)[2]
+        cond = line.split(',')[-1]
+        holds = {'eq':z_flag, 'ne':not z_flag, 'lt':n_flag, 'le':n_flag or z_flag, 'gt':not z_flag and not n_flag,
+                 'ge':not n_flag, 'mi':n_flag, 'pl':not n_flag or z_flag}[cond]
+        reg[rd] = reg[rn] if holds else reg[rm]
+        return
     '''
     logical instructions
     '''
@@ -0,0 +1,220 @@
+#include "cache.hpp"
+
+#include <charconv>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string_view>
+
+#include "utilities.hpp"
+
+namespace {
+
+// 64 bit FNV-1a
+class Hasher {
+public:
+    void add(std::string_view bytes) {
+        this->addRaw(bytes.size());
+        for (const auto c : bytes) {
+            this->hash ^= static_cast<uint8_t>(c);
+            this->hash *= 0x100000001b3;
+        }
+    }
+    void add(int64_t number) {
+        this->addRaw(number);
+    }
+    void add(const IRValue& value) {
+        this->add(value.type);
+        this->add(value.value);
+        this->add(value.name);
+    }
+    [[nodiscard]] std::string getHex() const {
+        char buffer[16];
+        const auto [ptr, ec] = std::to_chars(buffer, buffer + sizeof(buffer), this->hash, 16);
+        return std::string(16 - (ptr - buffer), '0') + std::string{buffer, ptr};
+    }
+private:
+    uint64_t hash = 0xcbf29ce484222325;
+
+    void addRaw(uint64_t number) {
+        for (int i = 0; i < 8; i++, number >>= 8) {
+            this->hash ^= number & 0xff;
+            this->hash *= 0x100000001b3;
+        }
+    }
+};
+
+bool readNumbers(std::string_view& in, std::vector<uint32_t>& values) {
+    std::size_t count;
+    // Every number takes up at least one byte, a count any larger means the file is truncated or corrupt
+    if (!readNumber(in, count) || count > in.size())
+        return false;
+    values.resize(count);
+    for (auto& value : values) {
+        std::size_t number;
+        if (!readNumber(in, number))
+            return false;
+        value = static_cast<uint32_t>(number);
+    }
+    return true;
+}
+
+// Roughly how much memory an entry takes up
+std::size_t getEntrySize(const std::string& key, const CompiledFunction& function) {
+    std::size_t size = key.size() + function.assembly.size() + function.lines.size() * sizeof(uint32_t);
+    for (const auto& label : function.definedLabels)
+        size += label.size();
+    for (const auto& label : function.referencedLabels)
+        size += label.size();
+    for (const auto& [label, str] : function.strings)
+        size += label.size() + str.size();
+    return size;
+}
+
+void writeNumbers(std::string& out, const std::vector<uint32_t>& values) {
+    out += std::to_string(values.size());
+    out += '\n';
+    for (const auto value : values) {
+        out += std::to_string(value);
+        out += '\n';
+    }
+}
+
+} // namespace
+
+FunctionCache::FunctionCache(std::string directory_)
+        : directory(std::move(directory_)) {
+    if (this->directory.empty())
+        return;
+    std::error_code error;
+    std::filesystem::create_directories(this->directory, error);
+}
+
+std::string FunctionCache::getKey(const IRFunction& function, int optimizationLevel, Target target) {
+    Hasher hasher;
+    hasher.add(ARMCOMP_VERSION);
+    hasher.add(optimizationLevel);
+    hasher.add(target);
+    hasher.add(function.name);
+    hasher.add(function.isProcedure);
+    hasher.add(function.parameterCount);
+    hasher.add(function.variableCount);
+    for (const auto& str : function.strings)
+        hasher.add(str);
+    hasher.add(static_cast<int64_t>(function.code.size()));
+    for (const auto& instr : function.code) {
+        hasher.add(instr.opcode);
+        hasher.add(instr.dst);
+        hasher.add(static_cast<int64_t>(instr.operands.size()));
+        for (const auto& operand : instr.operands)
+            hasher.add(operand);
+        hasher.add(instr.condition);
+        hasher.add(instr.label);
+        hasher.add(instr.text);
+        hasher.add(instr.external);
+        // The source map is cached with lines counted from the declaration, so those have to match too
+        hasher.add(instr.line > 0 ? static_cast<int64_t>(instr.line) - function.position.line + 1 : 0);
+    }
+    return hasher.getHex();
+}
+
+bool FunctionCache::load(const std::string& key, CompiledFunction& function) const {
+    {
+        std::lock_guard lock{this->mutex};
+        if (const auto entry = this->entries.find(key); entry != this->entries.end()) {
+            function = entry->second;
+            return true;
+        }
+    }
+    if (this->directory.empty())
+        return false;
+    try {
+        if (!this->loadFile(key, function))
+            return false;
+    } catch (const std::exception&) {
+        // An entry that can't be read is only a miss, the function is compiled again and the entry rewritten
+        return false;
+    }
+    std::lock_guard lock{this->mutex};
+    this->addEntry(key, function);
+    return true;
+}
+
+void FunctionCache::store(const std::string& key, const CompiledFunction& function) const {
+    {
+        std::lock_guard lock{this->mutex};
+        this->addEntry(key, function);
+    }
+    if (!this->directory.empty())
+        this->storeFile(key, function);
+}
+
+void FunctionCache::addEntry(const std::string& key, const CompiledFunction& function) const {
+    const auto size = getEntrySize(key, function);
+    if (const auto entry = this->entries.find(key); entry != this->entries.end()) {
+        this->memory -= getEntrySize(entry->first, entry->second);
+        this->entries.erase(entry);
+    }
+    if (size > ARMCOMP_CACHE_MAX_MEMORY)
+        return;
+    while (this->memory + size > ARMCOMP_CACHE_MAX_MEMORY && !this->entries.empty()) {
+        const auto entry = this->entries.begin();
+        this->memory -= getEntrySize(entry->first, entry->second);
+        this->entries.erase(entry);
+    }
+    this->entries.emplace(key, function);
+    this->memory += size;
+}
+
+bool FunctionCache::loadFile(const std::string& key, CompiledFunction& function) const {
+    std::ifstream file{std::filesystem::path{this->directory} / key, std::ios::in | std::ios::binary};
+    if (!file.is_open())
+        return false;
+    const std::string contents{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+
+    std::string_view in = contents;
+    if (!in.starts_with(ARMCOMP_CACHE_FORMAT "\n"))
+        return false;
+    in.remove_prefix(sizeof(ARMCOMP_CACHE_FORMAT));
+
+    std::vector<std::string> strings;
+    if (!readStrings(in, function.definedLabels) || !readStrings(in, function.referencedLabels) || !readStrings(in, strings) || strings.size() % 2 != 0)
+        return false;
+    function.strings.clear();
+    for (int i = 0; i < strings.size(); i += 2)
+        function.strings.emplace_back(std::move(strings[i]), std::move(strings[i + 1]));
+    return readString(in, function.assembly) && readNumbers(in, function.lines) && in.empty();
+}
+
+void FunctionCache::storeFile(const std::string& key, const CompiledFunction& function) const {
+    std::string contents = ARMCOMP_CACHE_FORMAT "\n";
+    writeStrings(contents, function.definedLabels);
+    writeStrings(contents, function.referencedLabels);
+    contents += std::to_string(function.strings.size() * 2);
+    contents += '\n';
+    for (const auto& [label, str] : function.strings) {
+        writeString(contents, label);
+        writeString(contents, str);
+    }
+    writeString(contents, function.assembly);
+    writeNumbers(contents, function.lines);
+
+    // Written under a temporary name first, so other compilers never see half of an entry
+    const auto path = std::filesystem::path{this->directory} / key;
+    auto temporary = path;
+    temporary += '.' + std::to_string(std::random_device{}());
+    {
+        std::ofstream file{temporary, std::ios::out | std::ios::binary | std::ios::trunc};
+        if (!file.is_open())
+            return;
+        file.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+        if (!file)
+            return;
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+        std::filesystem::remove(temporary, error);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "instruction.hpp"
+#include "ir.hpp"
+
+#ifndef ARMCOMP_VERSION
+#define ARMCOMP_VERSION "unknown"
+#endif
+
+// Bumped whenever the layout of a cache file changes
+#define ARMCOMP_CACHE_FORMAT "armcomp-cache 2"
+// Roughly how many bytes of entries are kept in memory, a long running server would otherwise keep every one it saw
+#define ARMCOMP_CACHE_MAX_MEMORY (64 * 1024 * 1024)
+
+// Everything needed to link a compiled function into a program without compiling it again
+struct CompiledFunction {
+    // Labels other code can call or jump to, and labels this function calls or jumps to
+    std::vector<std::string> definedLabels;
+    std::vector<std::string> referencedLabels;
+    // Data label and contents of every string the function prints
+    std::vector<std::pair<std::string, std::string>> strings;
+    std::string assembly;
+    // Source line of each line of assembly counting from the declaration, which is 1, or 0 if it isn't known
+    std::vector<uint32_t> lines;
+};
+
+// Keeps compiled functions on disk, one file per function named after the hash of its IR.
+// Entries are kept in memory as well, so parsers sharing a cache only read each one once. Once they take up too much
+// memory, entries are dropped in no particular order, they can still be read back from disk if there is a directory
+class FunctionCache {
+public:
+    // An empty directory keeps entries in memory only
+    explicit FunctionCache(std::string directory);
+
+    // The IR captures everything the assembly depends on, including how names in the function were resolved. Source lines
+    // are counted from the declaration, so moving the whole function still finds it but moving lines inside it doesn't
+    [[nodiscard]] static std::string getKey(const IRFunction& function, int optimizationLevel, Target target);
+
+    // Returns false if the function isn't cached or the entry can't be read
+    [[nodiscard]] bool load(const std::string& key, CompiledFunction& function) const;
+    // Failing to write an entry isn't an error, it will just be compiled again next time
+    void store(const std::string& key, const CompiledFunction& function) const;
+private:
+    std::string directory;
+    mutable std::mutex mutex;
+    mutable std::unordered_map<std::string, CompiledFunction> entries;
+    // Total size of the entries
+    mutable std::size_t memory = 0;
+
+    // Must be called with the mutex held
+    void addEntry(const std::string& key, const CompiledFunction& function) const;
+
+    [[nodiscard]] bool loadFile(const std::string& key, CompiledFunction& function) const;
+    void storeFile(const std::string& key, const CompiledFunction& function) const;
+};
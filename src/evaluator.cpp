@@ -0,0 +1,147 @@
+#include "evaluator.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+
+Evaluator::Evaluator(IRFunction& function_, const std::unordered_map<std::string, IRFunction>& callees_)
+        : function(function_)
+        , callees(callees_) {}
+
+int Evaluator::run() {
+    int count = 0;
+    for (auto& instr : this->function.code) {
+        if (instr.opcode != IR_CALL)
+            continue;
+        const auto callee = this->callees.find(instr.label);
+        if (callee == this->callees.end() || !std::all_of(instr.operands.begin(), instr.operands.end(), [](const IRValue& operand) { return operand.isConstant(); }))
+            continue;
+        std::vector<int64_t> arguments;
+        for (const auto& operand : instr.operands)
+            arguments.push_back(operand.value);
+        int steps = 0;
+        if (const auto result = this->evaluate(callee->second, arguments, std::nullopt, 0, steps)) {
+            instr = {.opcode = IR_MOVE, .dst = IRValue::variable(IR_RETURN_VARIABLE), .operands = {IRValue::constant(*result)}, .line = instr.line};
+            count++;
+        }
+    }
+    return count;
+}
+
+bool Evaluator::isPure(const IRFunction& function, const std::unordered_map<std::string, IRFunction>& pureFunctions) {
+    std::unordered_set<std::string> labels;
+    for (const auto& instr : function.code) {
+        if (instr.opcode == IR_LABEL) {
+            // goto can jump into the middle of the function from anywhere
+            if (instr.external)
+                return false;
+            labels.insert(instr.label);
+        }
+    }
+    return std::all_of(function.code.begin(), function.code.end(), [&](const IRInstruction& instr) {
+        switch (instr.opcode) {
+            case IR_PRINT:
+            case IR_EXIT:
+            case IR_ASM:
+                return false;
+            case IR_BRANCH:
+            case IR_JUMP:
+                return labels.contains(instr.label);
+            case IR_CALL:
+            case IR_TAIL_CALL:
+                return instr.label == function.name || pureFunctions.contains(instr.label);
+            default:
+                return std::none_of(instr.operands.begin(), instr.operands.end(), [](const IRValue& operand) {
+                    return operand.type == IR_VALUE_SYMBOL;
+                });
+        }
+    });
+}
+
+std::optional<int64_t> Evaluator::evaluate(const IRFunction& callee, const std::vector<int64_t>& arguments, std::optional<int64_t> returnValue, int depth, int& steps) {
+    if (depth >= IR_EVALUATOR_MAX_DEPTH)
+        return std::nullopt;
+    auto& labels = this->labels[&callee];
+    if (labels.empty()) {
+        for (std::size_t i = 0; i < callee.code.size(); i++) {
+            if (callee.code[i].opcode == IR_LABEL)
+                labels[callee.code[i].label] = i;
+        }
+    }
+
+    // Variables nothing has been written to yet hold whatever was left in their register
+    std::vector<std::optional<int64_t>> variables(callee.variableCount);
+    variables[IR_RETURN_VARIABLE] = returnValue;
+    for (int i = 0; i < callee.parameterCount; i++)
+        variables[i + 1] = arguments[i];
+    const auto read = [&variables](const IRValue& value) -> std::optional<int64_t> {
+        if (value.isConstant())
+            return value.value;
+        if (value.isVariable())
+            return variables[value.value];
+        return std::nullopt;
+    };
+
+    for (std::size_t pc = 0; pc < callee.code.size();) {
+        const auto& instr = callee.code[pc++];
+        if (instr.opcode == IR_LABEL)
+            continue;
+        if (++steps > IR_EVALUATOR_MAX_STEPS)
+            return std::nullopt;
+        switch (instr.opcode) {
+            case IR_MOVE:
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV: {
+                const auto a = read(instr.operands[0]);
+                const auto b = instr.opcode == IR_MOVE ? a : read(instr.operands[1]);
+                int64_t result;
+                if (!a || !b || !evaluateArithmetic(instr.opcode, *a, *b, result))
+                    return std::nullopt;
+                variables[instr.dst.value] = result;
+                break;
+            }
+            case IR_BRANCH: {
+                const auto a = read(instr.operands[0]);
+                const auto b = read(instr.operands[1]);
+                if (!a || !b)
+                    return std::nullopt;
+                if (evaluateCondition(instr.condition, *a, *b))
+                    pc = labels.at(instr.label);
+                break;
+            }
+            case IR_JUMP:
+                pc = labels.at(instr.label);
+                break;
+            case IR_CALL:
+            case IR_TAIL_CALL: {
+                // Functions are only pure if everything they call is, and they are in callees by then
+                const auto target = this->callees.find(instr.label);
+                if (target == this->callees.end())
+                    return std::nullopt;
+                std::vector<int64_t> values;
+                for (const auto& operand : instr.operands) {
+                    const auto value = read(operand);
+                    if (!value)
+                        return std::nullopt;
+                    values.push_back(*value);
+                }
+                variables[IR_RETURN_VARIABLE] = this->evaluate(target->second, values, variables[IR_RETURN_VARIABLE], depth + 1, steps);
+                if (!variables[IR_RETURN_VARIABLE])
+                    return std::nullopt;
+                if (instr.opcode == IR_TAIL_CALL)
+                    return variables[IR_RETURN_VARIABLE];
+                break;
+            }
+            case IR_RETURN:
+                if (!instr.operands.empty())
+                    return read(instr.operands[0]);
+                // Falling off the end keeps "_" as it is, return on its own gives 0
+                return instr.external ? variables[IR_RETURN_VARIABLE] : 0;
+            default:
+                // Anything else can be seen from outside the function
+                return std::nullopt;
+        }
+    }
+    return variables[IR_RETURN_VARIABLE];
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ir.hpp"
+
+// Each call is given up on once it has run this many instructions, counting the functions it calls
+#define IR_EVALUATOR_MAX_STEPS 100000
+// The program has a 4 KB stack, a call nested any deeper might have run out of it at runtime
+#define IR_EVALUATOR_MAX_DEPTH 8
+
+// Replaces calls to pure functions with constant arguments by the value they return
+class Evaluator {
+public:
+    // The callees must not have been split into blocks yet
+    Evaluator(IRFunction& function, const std::unordered_map<std::string, IRFunction>& callees);
+    // Returns how many calls were replaced
+    int run();
+
+    // True if the function can only change "_", because it never prints, exits, runs raw asm, has user labels or jumps
+    // out of itself, and only calls itself and functions in pureFunctions
+    [[nodiscard]] static bool isPure(const IRFunction& function, const std::unordered_map<std::string, IRFunction>& pureFunctions);
+private:
+    IRFunction& function;
+    const std::unordered_map<std::string, IRFunction>& callees;
+    // Where each label of a callee is, found the first time it is evaluated
+    std::unordered_map<const IRFunction*, std::unordered_map<std::string, std::size_t>> labels;
+
+    // Runs a callee, returns what it leaves in "_" or nothing if it reads a value that isn't known, divides by zero,
+    // or takes too many steps. returnValue is "_" on entry, which is unknown unless the callee set it itself
+    [[nodiscard]] std::optional<int64_t> evaluate(const IRFunction& callee, const std::vector<int64_t>& arguments, std::optional<int64_t> returnValue, int depth, int& steps);
+};
@@ -0,0 +1,96 @@
+#include "expression.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+std::unique_ptr<Expression> Expression::leaf(const IRValue& value) {
+    auto expression = std::make_unique<Expression>();
+    expression->value = value;
+    return expression;
+}
+
+std::unique_ptr<Expression> Expression::binary(IROpcode opcode, std::unique_ptr<Expression> left, std::unique_ptr<Expression> right) {
+    auto expression = std::make_unique<Expression>();
+    expression->opcode = opcode;
+    // Leaves are used in place, a node needs one more temporary than its children only if both need the same amount
+    const int leftCount = left->temporaryCount, rightCount = right->temporaryCount;
+    expression->temporaryCount = leftCount == rightCount ? leftCount + 1 : std::max(leftCount, rightCount);
+    expression->left = std::move(left);
+    expression->right = std::move(right);
+    return expression;
+}
+
+ExpressionParser::ExpressionParser(std::string_view source_, ValueResolver resolver_)
+        : source(source_)
+        , resolver(std::move(resolver_)) {}
+
+std::unique_ptr<Expression> ExpressionParser::parse() {
+    auto expression = this->parseSum();
+    if (!expression || this->peek() != '\0')
+        return nullptr;
+    return expression;
+}
+
+std::unique_ptr<Expression> ExpressionParser::parseSum() {
+    auto expression = this->parseProduct();
+    while (expression && (this->peek() == '+' || this->peek() == '-')) {
+        const auto opcode = this->source[this->pos++] == '+' ? IR_ADD : IR_SUB;
+        auto right = this->parseProduct();
+        if (!right)
+            return nullptr;
+        expression = Expression::binary(opcode, std::move(expression), std::move(right));
+    }
+    return expression;
+}
+
+std::unique_ptr<Expression> ExpressionParser::parseProduct() {
+    auto expression = this->parseUnary();
+    while (expression && (this->peek() == '*' || this->peek() == '/')) {
+        const auto opcode = this->source[this->pos++] == '*' ? IR_MUL : IR_DIV;
+        auto right = this->parseUnary();
+        if (!right)
+            return nullptr;
+        expression = Expression::binary(opcode, std::move(expression), std::move(right));
+    }
+    return expression;
+}
+
+std::unique_ptr<Expression> ExpressionParser::parseUnary() {
+    if (this->peek() != '-')
+        return this->parsePrimary();
+    this->pos++;
+    auto operand = this->parseUnary();
+    if (!operand)
+        return nullptr;
+    // Negative literals don't need any code
+    if (operand->isLeaf() && operand->value.isConstant()) {
+        operand->value.value = static_cast<int64_t>(0 - static_cast<uint64_t>(operand->value.value));
+        return operand;
+    }
+    return Expression::binary(IR_SUB, Expression::leaf(IRValue::constant(0)), std::move(operand));
+}
+
+std::unique_ptr<Expression> ExpressionParser::parsePrimary() {
+    if (this->peek() == '(') {
+        this->pos++;
+        auto expression = this->parseSum();
+        if (!expression || this->peek() != ')')
+            return nullptr;
+        this->pos++;
+        return expression;
+    }
+
+    const auto start = this->pos;
+    while (this->pos < this->source.size() && (std::isalnum(this->source[this->pos]) || this->source[this->pos] == '_'))
+        this->pos++;
+    IRValue value;
+    if (start == this->pos || !this->resolver(this->source.substr(start, this->pos - start), value))
+        return nullptr;
+    return Expression::leaf(value);
+}
+
+char ExpressionParser::peek() {
+    while (this->pos < this->source.size() && this->source[this->pos] == ' ')
+        this->pos++;
+    return this->pos < this->source.size() ? this->source[this->pos] : '\0';
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "ir.hpp"
+
+struct Expression {
+    // Leaves hold a value, every other node applies the opcode to both children
+    IRValue value;
+    IROpcode opcode = IR_MOVE;
+    std::unique_ptr<Expression> left;
+    std::unique_ptr<Expression> right;
+    // How many temporaries are needed to evaluate this subtree (its Sethi-Ullman number)
+    int temporaryCount = 0;
+
+    [[nodiscard]] static std::unique_ptr<Expression> leaf(const IRValue& value);
+    [[nodiscard]] static std::unique_ptr<Expression> binary(IROpcode opcode, std::unique_ptr<Expression> left, std::unique_ptr<Expression> right);
+
+    [[nodiscard]] bool isLeaf() const {
+        return !this->left;
+    }
+};
+
+class ExpressionParser {
+public:
+    // Turns an identifier or number into a value, returns false if it can't be used in an expression
+    using ValueResolver = std::function<bool(std::string_view, IRValue&)>;
+
+    ExpressionParser(std::string_view source, ValueResolver resolver);
+    // Parses the whole source, returns nullptr if it is not a valid expression
+    [[nodiscard]] std::unique_ptr<Expression> parse();
+private:
+    std::string_view source;
+    std::size_t pos = 0;
+    ValueResolver resolver;
+
+    [[nodiscard]] std::unique_ptr<Expression> parseSum();
+    [[nodiscard]] std::unique_ptr<Expression> parseProduct();
+    [[nodiscard]] std::unique_ptr<Expression> parseUnary();
+    [[nodiscard]] std::unique_ptr<Expression> parsePrimary();
+
+    [[nodiscard]] char peek();
+};
@@ -1,5 +1,24 @@
 #include "filewriter.hpp"
 
+#include <algorithm>
+
+void FileWriter::writeRaw(std::string_view text) {
+    this->contents += text;
+    this->lineCount += std::count(text.begin(), text.end(), '\n');
+}
+
+void FileWriter::reserve(std::size_t additional) {
+    this->contents.reserve(this->contents.size() + additional);
+}
+
+std::size_t FileWriter::getSize() const {
+    return this->contents.size();
+}
+
+std::size_t FileWriter::getLineCount() const {
+    return this->lineCount;
+}
+
 const std::string& FileWriter::getContents() const {
     return this->contents;
 }
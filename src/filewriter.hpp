@@ -1,20 +1,41 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
+#include <string_view>
 
+// Lines are appended straight into one growing buffer, so the output is never copied while it is being built
 class FileWriter {
 public:
     FileWriter() = default;
-    FileWriter& operator<<(const auto& line) {
+    FileWriter& operator<<(std::string_view line) {
         this->writeLine(line);
         return *this;
     }
-    void writeLine(const auto& line, bool newline = true) {
-        for (int i = 0; i < this->indentLevel; i++) {
-            this->contents += '\t';
+    void writeLine(std::string_view line, bool newline = true) {
+        this->contents.append(this->indentLevel, '\t');
+        this->contents += line;
+        if (newline) {
+            this->contents += '\n';
+            this->lineCount++;
         }
-        this->contents += line + std::string{newline ? "\n" : ""};
     }
+    // Starts an indented line, its text is appended to the returned buffer before calling endLine
+    [[nodiscard]] std::string& beginLine() {
+        this->contents.append(this->indentLevel, '\t');
+        return this->contents;
+    }
+    void endLine() {
+        this->contents += '\n';
+        this->lineCount++;
+    }
+    // Appends text that is already formatted as is
+    void writeRaw(std::string_view text);
+    // Makes room for this many more bytes up front
+    void reserve(std::size_t additional);
+    [[nodiscard]] std::size_t getSize() const;
+    // Number of complete lines written so far
+    [[nodiscard]] std::size_t getLineCount() const;
     [[nodiscard]] const std::string& getContents() const;
     [[nodiscard]] int getIndent() const;
     void setIndent(int indent);
@@ -23,4 +44,5 @@ public:
 private:
     int indentLevel = 0;
     std::string contents;
+    std::size_t lineCount = 0;
 };
@@ -0,0 +1,112 @@
+#include "inliner.hpp"
+
+#include <unordered_set>
+#include <utility>
+
+Inliner::Inliner(IRFunction& function_, const std::unordered_map<std::string, IRFunction>& callees_)
+        : function(function_)
+        , callees(callees_) {}
+
+int Inliner::run() {
+    int count = 0;
+    std::vector<IRInstruction> out;
+    out.reserve(this->function.code.size());
+    for (auto& instr : this->function.code) {
+        if (instr.opcode == IR_CALL) {
+            if (const auto callee = this->callees.find(instr.label); callee != this->callees.end()) {
+                this->inlineCall(instr, callee->second, out);
+                count++;
+                continue;
+            }
+        }
+        out.push_back(std::move(instr));
+    }
+    this->function.code = std::move(out);
+    return count;
+}
+
+int Inliner::getCost(const IRFunction& function) {
+    std::unordered_set<std::string> labels;
+    for (const auto& instr : function.code) {
+        if (instr.opcode == IR_LABEL) {
+            if (instr.external)
+                return -1;
+            labels.insert(instr.label);
+        }
+    }
+    int cost = 0;
+    for (const auto& instr : function.code) {
+        switch (instr.opcode) {
+            case IR_LABEL:
+                break;
+            case IR_ASM:
+                return -1;
+            case IR_CALL:
+                if (instr.label == function.name)
+                    return -1;
+                cost++;
+                break;
+            case IR_BRANCH:
+            case IR_JUMP:
+                if (!labels.contains(instr.label))
+                    return -1;
+                cost++;
+                break;
+            default:
+                cost++;
+                break;
+        }
+    }
+    return cost;
+}
+
+void Inliner::inlineCall(const IRInstruction& call, const IRFunction& callee, std::vector<IRInstruction>& out) {
+    // Every variable but "_" gets a new one in the caller, "_" is shared with the callee just like it is for a real call
+    const int offset = this->function.variableCount - 1;
+    const auto rename = [offset](IRValue& value) {
+        if (value.isVariable() && value.value != IR_RETURN_VARIABLE)
+            value.value += offset;
+    };
+    for (int variable = 1; variable < callee.variableCount; variable++)
+        this->function.symbols.push_back(callee.symbols[variable]);
+    this->function.variableCount += callee.variableCount - 1;
+
+    std::unordered_map<std::string, std::string> labels;
+    for (const auto& instr : callee.code) {
+        if (instr.opcode == IR_LABEL)
+            labels[instr.label] = "." + this->function.getLocalName(IR_INLINE_LABEL_PREFIX, this->function.labelCount++);
+    }
+    const auto returnLabel = "." + this->function.getLocalName(IR_INLINE_LABEL_PREFIX, this->function.labelCount++);
+    // Strings keep their labels, they only need to be stored with the caller
+    for (const auto& str : callee.strings)
+        this->function.addString(str);
+
+    // The copy belongs to the line making the call, the callee may not even be in the same file
+    for (int i = 0; i < callee.parameterCount; i++)
+        out.push_back({.opcode = IR_MOVE, .dst = IRValue::variable(offset + 1 + i), .operands = {call.operands[i]}, .line = call.line});
+    for (auto instr : callee.code) {
+        instr.line = call.line;
+        rename(instr.dst);
+        for (auto& operand : instr.operands)
+            rename(operand);
+        switch (instr.opcode) {
+            case IR_LABEL:
+            case IR_BRANCH:
+            case IR_JUMP:
+                instr.label = labels.at(instr.label);
+                break;
+            case IR_RETURN:
+                // The result is left in "_" like a call would, then the caller carries on after the copy
+                if (!instr.operands.empty())
+                    out.push_back({.opcode = IR_MOVE, .dst = IRValue::variable(IR_RETURN_VARIABLE), .operands = {instr.operands[0]}, .line = call.line});
+                else if (!instr.external)
+                    out.push_back({.opcode = IR_MOVE, .dst = IRValue::variable(IR_RETURN_VARIABLE), .operands = {IRValue::constant(0)}, .line = call.line});
+                instr = {.opcode = IR_JUMP, .label = returnLabel, .line = call.line};
+                break;
+            default:
+                break;
+        }
+        out.push_back(std::move(instr));
+    }
+    out.push_back({.opcode = IR_LABEL, .label = returnLabel, .line = call.line});
+}
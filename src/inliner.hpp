@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include "ir.hpp"
+
+// Functions costing at most this many instructions are inlined at -O1, and up to the larger cost at -O2
+#define IR_INLINE_SMALL_COST 8
+#define IR_INLINE_LARGE_COST 32
+#define IR_INLINE_LABEL_PREFIX "_inline"
+
+// Replaces calls with a copy of the function being called, its variables and labels are renamed into the caller
+class Inliner {
+public:
+    // The callees must not have been split into blocks yet
+    Inliner(IRFunction& function, const std::unordered_map<std::string, IRFunction>& callees);
+    // Returns how many calls were replaced
+    int run();
+
+    // Number of instructions a copy of the function adds, or -1 if it can't be copied because it has raw asm, user labels,
+    // jumps out of itself or calls itself
+    [[nodiscard]] static int getCost(const IRFunction& function);
+private:
+    IRFunction& function;
+    const std::unordered_map<std::string, IRFunction>& callees;
+
+    void inlineCall(const IRInstruction& call, const IRFunction& callee, std::vector<IRInstruction>& out);
+};
@@ -0,0 +1,228 @@
+#include "instruction.hpp"
+
+#include <charconv>
+
+MachineOperand MachineOperand::reg(int number) {
+    return {OPERAND_REGISTER, number};
+}
+
+MachineOperand MachineOperand::virt(int id) {
+    return {OPERAND_VIRTUAL, id};
+}
+
+MachineOperand MachineOperand::imm(int64_t value) {
+    return {OPERAND_IMMEDIATE, value};
+}
+
+MachineOperand MachineOperand::label(const std::string& name) {
+    return {OPERAND_LABEL, 0, ASM_REGISTER_SP, ADDRESS_OFFSET, name};
+}
+
+MachineOperand MachineOperand::symbol(const std::string& name) {
+    return {OPERAND_SYMBOL, 0, ASM_REGISTER_SP, ADDRESS_OFFSET, name};
+}
+
+MachineOperand MachineOperand::memory(int base, int64_t offset, AddressMode mode) {
+    return {OPERAND_MEMORY, offset, base, mode};
+}
+
+MachineOperand MachineOperand::condition(int branch) {
+    return {OPERAND_CONDITION, branch};
+}
+
+static void appendNumber(std::string& out, int64_t number) {
+    char buffer[24];
+    const auto [ptr, ec] = std::to_chars(buffer, buffer + sizeof(buffer), number);
+    out.append(buffer, ptr);
+}
+
+static void appendRegister(std::string& out, int64_t number) {
+    if (number == ASM_REGISTER_SP) {
+        out += "sp";
+    } else if (number == ASM_REGISTER_LR) {
+        out += "lr";
+    } else {
+        out += 'x';
+        appendNumber(out, number);
+    }
+}
+
+static void appendOffset(std::string& out, int64_t offset) {
+    // Stack adjustments read better in hex, matching the hand written prologues
+    char buffer[24];
+    const auto magnitude = static_cast<uint64_t>(offset < 0 ? -offset : offset);
+    const auto [ptr, ec] = std::to_chars(buffer, buffer + sizeof(buffer), magnitude, 16);
+    out += offset < 0 ? "#-0x" : "#0x";
+    out.append(buffer, ptr);
+}
+
+void MachineOperand::writeTo(std::string& out) const {
+    switch (this->type) {
+        case OPERAND_NONE:
+            break;
+        case OPERAND_REGISTER:
+            appendRegister(out, this->value);
+            break;
+        case OPERAND_VIRTUAL:
+            out += 'v';
+            appendNumber(out, this->value);
+            break;
+        case OPERAND_IMMEDIATE:
+            out += '#';
+            appendNumber(out, this->value);
+            break;
+        case OPERAND_LABEL:
+            out += this->name;
+            break;
+        case OPERAND_SYMBOL:
+            out += '=';
+            out += this->name;
+            break;
+        case OPERAND_MEMORY:
+            out += '[';
+            appendRegister(out, this->base);
+            switch (this->mode) {
+                case ADDRESS_OFFSET:
+                    if (this->value != 0) {
+                        out += ", ";
+                        appendOffset(out, this->value);
+                    }
+                    out += ']';
+                    break;
+                case ADDRESS_PRE_INDEX:
+                    out += ", ";
+                    appendOffset(out, this->value);
+                    out += "]!";
+                    break;
+                case ADDRESS_POST_INDEX:
+                    out += "], ";
+                    appendOffset(out, this->value);
+                    break;
+            }
+            break;
+        case OPERAND_CONDITION: {
+            static constexpr const char* conditions[] = {"eq", "ne", "lt", "le", "gt", "ge"};
+            out += conditions[this->value - MNEMONIC_BEQ];
+            break;
+        }
+    }
+}
+
+std::string MachineOperand::toString() const {
+    std::string out;
+    this->writeTo(out);
+    return out;
+}
+
+MachineInstruction::MachineInstruction(Mnemonic mnemonic_, std::vector<MachineOperand> operands_)
+        : mnemonic(mnemonic_)
+        , operands(std::move(operands_)) {}
+
+bool MachineInstruction::definesFirstOperand() const {
+    switch (this->mnemonic) {
+        case MNEMONIC_MOV:
+        case MNEMONIC_ADD:
+        case MNEMONIC_SUB:
+        case MNEMONIC_MUL:
+        case MNEMONIC_SDIV:
+        case MNEMONIC_MADD:
+        case MNEMONIC_MSUB:
+        case MNEMONIC_LSL:
+        case MNEMONIC_ASR:
+        case MNEMONIC_CSEL:
+        case MNEMONIC_LDR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool MachineInstruction::isConditionalBranch() const {
+    return this->mnemonic >= MNEMONIC_BEQ && this->mnemonic <= MNEMONIC_CBNZ;
+}
+
+bool MachineInstruction::endsControlFlow() const {
+    return this->mnemonic == MNEMONIC_B || this->mnemonic == MNEMONIC_RET || this->mnemonic == MNEMONIC_RETURN || this->mnemonic == MNEMONIC_TAIL_CALL;
+}
+
+void MachineInstruction::writeTo(std::string& out) const {
+    static constexpr const char* names[] = {
+        "", "mov", "add", "sub", "mul", "sdiv", "madd", "msub", "lsl", "asr", "cmp", "csel",
+        "b", "beq", "bne", "blt", "ble", "bgt", "bge", "cbz", "cbnz",
+        "bl", "ret", "svc", "ldr", "str", "ldp", "stp",
+    };
+
+    if (this->mnemonic == MNEMONIC_LABEL) {
+        out += this->operands[0].name;
+        out += ':';
+        return;
+    }
+    if (this->mnemonic == MNEMONIC_RAW) {
+        // Copy the text across, swapping each ${N} placeholder for its operand
+        std::string_view text = this->text;
+        for (auto found = text.find("${"); found != std::string_view::npos; found = text.find("${")) {
+            const auto close = text.find('}', found);
+            std::size_t index = 0;
+            const auto [ptr, ec] = std::from_chars(text.data() + found + 2, text.data() + (close == std::string_view::npos ? text.size() : close), index);
+            if (close == std::string_view::npos || ec != std::errc{} || ptr != text.data() + close || index >= this->operands.size()) {
+                out += text.substr(0, found + 2);
+                text.remove_prefix(found + 2);
+                continue;
+            }
+            out += text.substr(0, found);
+            this->operands[index].writeTo(out);
+            text.remove_prefix(close + 1);
+        }
+        out += text;
+        return;
+    }
+    if (this->mnemonic == MNEMONIC_PROLOGUE) {
+        out += "<prologue>";
+        return;
+    }
+    if (this->mnemonic == MNEMONIC_CALL) {
+        out += "<call ";
+        out += this->operands[0].name;
+        out += '>';
+        return;
+    }
+    if (this->mnemonic == MNEMONIC_RETURN) {
+        out += "<return>";
+        return;
+    }
+    // svc takes a bare immediate
+    if (this->mnemonic == MNEMONIC_SVC) {
+        out += "svc 0";
+        return;
+    }
+
+    out += names[this->mnemonic];
+    for (int i = 0; i < this->operands.size(); i++) {
+        out += i == 0 ? " " : ", ";
+        this->operands[i].writeTo(out);
+    }
+}
+
+std::string MachineInstruction::toString() const {
+    std::string out;
+    this->writeTo(out);
+    return out;
+}
+
+void writeInstructions(FileWriter& writer, const std::vector<MachineInstruction>& code, std::vector<uint32_t>* lines) {
+    // Most lines are short, so this is usually the only time the output grows for a function
+    writer.reserve(code.size() * ASM_AVERAGE_LINE_LENGTH);
+    for (const auto& instr : code) {
+        if (instr.mnemonic == MNEMONIC_LABEL) {
+            writer.dedent();
+            instr.writeTo(writer.beginLine());
+            writer.endLine();
+            writer.indent();
+        } else {
+            instr.writeTo(writer.beginLine());
+            writer.endLine();
+        }
+        if (lines)
+            lines->push_back(instr.line);
+    }
+}
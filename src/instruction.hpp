@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "filewriter.hpp"
+
+// Physical register numbers used by machine operands
+#define ASM_REGISTER_LR 30
+#define ASM_REGISTER_SP 31
+
+// Code is always selected for AArch64, other targets translate it once registers are allocated
+enum Target {
+    TARGET_AARCH64 = 0,
+    TARGET_X86_64  = 1,
+};
+
+// Rough length of a line of assembly including its indentation, used to size the output ahead of time
+#define ASM_AVERAGE_LINE_LENGTH 20
+
+enum OperandType {
+    OPERAND_NONE      = 0,
+    OPERAND_REGISTER  = 1,
+    OPERAND_VIRTUAL   = 2,
+    OPERAND_IMMEDIATE = 3,
+    OPERAND_LABEL     = 4,
+    OPERAND_SYMBOL    = 5,
+    OPERAND_MEMORY    = 6,
+    // Condition of a csel, held as the conditional branch that is taken under it
+    OPERAND_CONDITION = 7,
+};
+
+enum AddressMode {
+    ADDRESS_OFFSET     = 0,
+    ADDRESS_PRE_INDEX  = 1,
+    ADDRESS_POST_INDEX = 2,
+};
+
+struct MachineOperand {
+    OperandType type = OPERAND_NONE;
+    // Register number, virtual register id, immediate value, or memory offset
+    int64_t value = 0;
+    // Base register of a memory operand
+    int base = ASM_REGISTER_SP;
+    AddressMode mode = ADDRESS_OFFSET;
+    std::string name;
+
+    [[nodiscard]] static MachineOperand reg(int number);
+    [[nodiscard]] static MachineOperand virt(int id);
+    [[nodiscard]] static MachineOperand imm(int64_t value);
+    [[nodiscard]] static MachineOperand label(const std::string& name);
+    [[nodiscard]] static MachineOperand symbol(const std::string& name);
+    [[nodiscard]] static MachineOperand memory(int base, int64_t offset, AddressMode mode = ADDRESS_OFFSET);
+    [[nodiscard]] static MachineOperand condition(int branch);
+
+    [[nodiscard]] bool isRegister(int number) const {
+        return this->type == OPERAND_REGISTER && this->value == number;
+    }
+    [[nodiscard]] bool operator==(const MachineOperand& other) const = default;
+    // Appends the operand as it is written in assembly
+    void writeTo(std::string& out) const;
+    [[nodiscard]] std::string toString() const;
+};
+
+enum Mnemonic {
+    MNEMONIC_LABEL = 0,
+    MNEMONIC_MOV,
+    MNEMONIC_ADD,
+    MNEMONIC_SUB,
+    MNEMONIC_MUL,
+    MNEMONIC_SDIV,
+    // rd = ra + rn * rm and rd = ra - rn * rm
+    MNEMONIC_MADD,
+    MNEMONIC_MSUB,
+    MNEMONIC_LSL,
+    MNEMONIC_ASR,
+    MNEMONIC_CMP,
+    // rd = condition ? rn : rm, using the flags set by the last cmp
+    MNEMONIC_CSEL,
+    MNEMONIC_B,
+    MNEMONIC_BEQ,
+    MNEMONIC_BNE,
+    MNEMONIC_BLT,
+    MNEMONIC_BLE,
+    MNEMONIC_BGT,
+    MNEMONIC_BGE,
+    // Branch if a register is or isn't zero, without needing a cmp
+    MNEMONIC_CBZ,
+    MNEMONIC_CBNZ,
+    MNEMONIC_BL,
+    MNEMONIC_RET,
+    MNEMONIC_SVC,
+    MNEMONIC_LDR,
+    MNEMONIC_STR,
+    MNEMONIC_LDP,
+    MNEMONIC_STP,
+    // Raw line from an asm block, virtual registers are substituted into ${N} placeholders
+    MNEMONIC_RAW,
+    // Pseudo instructions, expanded once registers and the stack frame are known
+    MNEMONIC_PROLOGUE,
+    MNEMONIC_CALL,
+    MNEMONIC_RETURN,
+    // Tears down the frame like a return, then branches to the callee
+    MNEMONIC_TAIL_CALL,
+};
+
+struct MachineInstruction {
+    Mnemonic mnemonic = MNEMONIC_RAW;
+    std::vector<MachineOperand> operands;
+    std::string text;
+    // Source line this was generated for, 0 if it isn't known
+    uint32_t line = 0;
+
+    MachineInstruction() = default;
+    MachineInstruction(Mnemonic mnemonic_, std::vector<MachineOperand> operands_ = {});
+
+    // True if the first operand is written by this instruction
+    [[nodiscard]] bool definesFirstOperand() const;
+    [[nodiscard]] bool isConditionalBranch() const;
+    // True if execution never falls through to the next instruction
+    [[nodiscard]] bool endsControlFlow() const;
+    // Appends the instruction without its indentation or newline
+    void writeTo(std::string& out) const;
+    [[nodiscard]] std::string toString() const;
+};
+
+// The source line of every line written is appended to lines, if given
+void writeInstructions(FileWriter& writer, const std::vector<MachineInstruction>& code, std::vector<uint32_t>* lines = nullptr);
@@ -0,0 +1,306 @@
+#include "ir.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <unordered_map>
+
+IRValue IRValue::variable(int id) {
+    return {IR_VALUE_VARIABLE, id};
+}
+
+IRValue IRValue::constant(int64_t value) {
+    return {IR_VALUE_CONSTANT, value};
+}
+
+IRValue IRValue::symbol(const std::string& name) {
+    return {IR_VALUE_SYMBOL, 0, name};
+}
+
+std::string IRValue::toString() const {
+    switch (this->type) {
+        case IR_VALUE_NONE:
+            break;
+        case IR_VALUE_VARIABLE:
+            return this->value == IR_RETURN_VARIABLE ? "_" : "%" + std::to_string(this->value);
+        case IR_VALUE_CONSTANT:
+            return std::to_string(this->value);
+        case IR_VALUE_SYMBOL:
+            return this->name;
+    }
+    return "";
+}
+
+std::string IRInstruction::toString() const {
+    static constexpr const char* operators[] = {"", " + ", " - ", " * ", " / "};
+    static constexpr const char* conditions[] = {" == ", " != ", " < ", " <= ", " > ", " >= "};
+
+    std::string out;
+    switch (this->opcode) {
+        case IR_MOVE:
+            return this->dst.toString() + " = " + this->operands[0].toString();
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+            return this->dst.toString() + " = " + this->operands[0].toString() + operators[this->opcode] + this->operands[1].toString();
+        case IR_BRANCH:
+            return "if " + this->operands[0].toString() + conditions[this->condition] + this->operands[1].toString() + " goto " + this->label;
+        case IR_JUMP:
+            return "goto " + this->label;
+        case IR_LABEL:
+            return this->label + ':';
+        case IR_CALL:
+        case IR_TAIL_CALL:
+            out = (this->opcode == IR_CALL ? "_ = " : "return ") + this->label + '(';
+            for (int i = 0; i < this->operands.size(); i++)
+                out += (i == 0 ? "" : ", ") + this->operands[i].toString();
+            return out + ')';
+        case IR_RETURN:
+            return this->operands.empty() ? "return" : "return " + this->operands[0].toString();
+        case IR_PRINT:
+            return "print " + this->label;
+        case IR_EXIT:
+            return this->operands.empty() ? "exit" : "exit " + this->operands[0].toString();
+        case IR_ASM:
+            out = this->text;
+            for (int i = 0; i < this->operands.size(); i++) {
+                const std::string placeholder = "${" + std::to_string(i) + '}';
+                for (auto found = out.find(placeholder); found != std::string::npos; found = out.find(placeholder))
+                    out.replace(found, placeholder.length(), this->operands[i].toString());
+            }
+            return "asm " + out;
+    }
+    return out;
+}
+
+IRFunction::IRFunction(std::string name_, bool isProcedure_)
+        : name(std::move(name_))
+        , isProcedure(isProcedure_) {}
+
+void IRFunction::buildBlocks() {
+    this->flatten();
+
+    // Blocks start at labels and after anything that can branch away
+    for (auto& instr : this->code) {
+        if (this->blocks.empty() || (instr.opcode == IR_LABEL && !this->blocks.back().code.empty()))
+            this->blocks.emplace_back();
+        const bool terminator = instr.isTerminator();
+        this->blocks.back().code.push_back(std::move(instr));
+        if (terminator)
+            this->blocks.emplace_back();
+    }
+    if (!this->blocks.empty() && this->blocks.back().code.empty())
+        this->blocks.pop_back();
+    this->code.clear();
+
+    std::unordered_map<std::string, int> labels;
+    for (int i = 0; i < this->blocks.size(); i++) {
+        const auto& first = this->blocks[i].code.front();
+        if (first.opcode == IR_LABEL) {
+            labels[first.label] = i;
+            this->blocks[i].hasUnknownPredecessors = first.external;
+        }
+    }
+
+    for (int i = 0; i < this->blocks.size(); i++) {
+        auto& block = this->blocks[i];
+        const auto& last = block.code.back();
+        if (last.opcode == IR_BRANCH || last.opcode == IR_JUMP) {
+            if (const auto target = labels.find(last.label); target != labels.end())
+                block.successors.push_back(target->second);
+            else
+                block.exitsToUnknownLabel = true;
+        }
+        const bool fallsThrough = last.opcode != IR_JUMP && last.opcode != IR_TAIL_CALL && last.opcode != IR_RETURN && last.opcode != IR_EXIT;
+        if (fallsThrough && i + 1 < this->blocks.size() && (block.successors.empty() || block.successors[0] != i + 1))
+            block.successors.push_back(i + 1);
+        for (int successor : block.successors)
+            this->blocks[successor].predecessors.push_back(i);
+    }
+}
+
+void IRFunction::flatten() {
+    for (auto& block : this->blocks) {
+        for (auto& instr : block.code)
+            this->code.push_back(std::move(instr));
+    }
+    this->blocks.clear();
+}
+
+std::vector<std::vector<bool>> IRFunction::getLiveOut() const {
+    const auto& blocks = this->blocks;
+    std::vector<std::vector<bool>> liveIn(blocks.size(), std::vector<bool>(this->variableCount));
+    std::vector<std::vector<bool>> liveOut(blocks.size(), std::vector<bool>(this->variableCount));
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = static_cast<int>(blocks.size()) - 1; i >= 0; i--) {
+            // Anything might be read after jumping somewhere we can't see
+            std::vector<bool> live(this->variableCount, blocks[i].exitsToUnknownLabel);
+            for (int successor : blocks[i].successors) {
+                for (int id = 0; id < this->variableCount; id++) {
+                    if (liveIn[successor][id])
+                        live[id] = true;
+                }
+            }
+            liveOut[i] = live;
+            for (auto instr = blocks[i].code.rbegin(); instr != blocks[i].code.rend(); ++instr)
+                instr->updateLiveness(live);
+            if (live != liveIn[i]) {
+                liveIn[i] = std::move(live);
+                changed = true;
+            }
+        }
+    }
+    return liveOut;
+}
+
+std::string IRFunction::addString(std::string contents) {
+    if (const auto label = this->stringLabels.find(contents); label != this->stringLabels.end())
+        return label->second;
+    auto label = getStringLabel(contents);
+    this->stringLabels.emplace(contents, label);
+    this->strings.push_back(std::move(contents));
+    return label;
+}
+
+std::string IRFunction::getLocalName(std::string_view prefix, int number) const {
+    std::string name = this->isProcedure ? '_' + this->name : "";
+    name += prefix;
+    name += std::to_string(number);
+    return name;
+}
+
+std::vector<std::string> IRFunction::getDefinedLabels() const {
+    std::vector<std::string> labels;
+    if (!this->name.empty())
+        labels.push_back(this->name);
+    this->forEachInstruction([&labels](const IRInstruction& instr) {
+        if (instr.opcode == IR_LABEL)
+            labels.push_back(instr.label);
+    });
+    return labels;
+}
+
+std::vector<std::string> IRFunction::getReferencedLabels() const {
+    std::vector<std::string> labels;
+    this->forEachInstruction([&labels](const IRInstruction& instr) {
+        if (instr.opcode == IR_CALL || instr.opcode == IR_TAIL_CALL || instr.opcode == IR_JUMP || instr.opcode == IR_BRANCH) {
+            labels.push_back(instr.label);
+        } else if (instr.opcode == IR_ASM) {
+            // Any identifier could be a branch target, it doesn't hurt to keep a function that isn't one
+            const auto isLabelChar = [](char c) {
+                return std::isalnum(c) || c == '_' || c == '.';
+            };
+            for (std::size_t pos = 0; pos < instr.text.size();) {
+                if (!isLabelChar(instr.text[pos])) {
+                    pos++;
+                    continue;
+                }
+                const auto start = pos;
+                while (pos < instr.text.size() && isLabelChar(instr.text[pos]))
+                    pos++;
+                labels.push_back(instr.text.substr(start, pos - start));
+            }
+        }
+    });
+    return labels;
+}
+
+std::string IRFunction::toString() const {
+    std::string out = (this->name.empty() ? "_start" : this->name) + ":\n";
+    for (int i = 0; i < this->blocks.size(); i++) {
+        out += "  ; block " + std::to_string(i) + '\n';
+        for (const auto& instr : this->blocks[i].code)
+            out += (instr.opcode == IR_LABEL ? "  " : "    ") + instr.toString() + '\n';
+    }
+    for (const auto& instr : this->code)
+        out += (instr.opcode == IR_LABEL ? "  " : "    ") + instr.toString() + '\n';
+    return out;
+}
+
+std::string getStringLabel(std::string_view contents) {
+    // FNV-1a, printed as a fixed number of hex digits
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const unsigned char c : contents) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+    char digits[16];
+    const auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), hash, 16);
+    std::string label = IR_STRING_LABEL_PREFIX;
+    label.append(sizeof(digits) - (end - digits), '0');
+    label.append(digits, end);
+    return label;
+}
+
+bool evaluateCondition(IRCondition condition, int64_t a, int64_t b) {
+    switch (condition) {
+        case IR_CONDITION_EQ:
+            return a == b;
+        case IR_CONDITION_NE:
+            return a != b;
+        case IR_CONDITION_LT:
+            return a < b;
+        case IR_CONDITION_LE:
+            return a <= b;
+        case IR_CONDITION_GT:
+            return a > b;
+        case IR_CONDITION_GE:
+            return a >= b;
+    }
+    return false;
+}
+
+IRCondition invertCondition(IRCondition condition) {
+    switch (condition) {
+        case IR_CONDITION_EQ:
+            return IR_CONDITION_NE;
+        case IR_CONDITION_NE:
+            return IR_CONDITION_EQ;
+        case IR_CONDITION_LT:
+            return IR_CONDITION_GE;
+        case IR_CONDITION_LE:
+            return IR_CONDITION_GT;
+        case IR_CONDITION_GT:
+            return IR_CONDITION_LE;
+        case IR_CONDITION_GE:
+            return IR_CONDITION_LT;
+    }
+    return condition;
+}
+
+bool evaluateArithmetic(IROpcode opcode, int64_t a, int64_t b, int64_t& result) {
+    // Wrap around like the hardware does instead of overflowing
+    const auto ua = static_cast<uint64_t>(a);
+    const auto ub = static_cast<uint64_t>(b);
+    switch (opcode) {
+        case IR_MOVE:
+            result = a;
+            return true;
+        case IR_ADD:
+            result = static_cast<int64_t>(ua + ub);
+            return true;
+        case IR_SUB:
+            result = static_cast<int64_t>(ua - ub);
+            return true;
+        case IR_MUL:
+            result = static_cast<int64_t>(ua * ub);
+            return true;
+        case IR_DIV:
+            // Division by zero is left for the program to fail on at runtime
+            if (b == 0)
+                return false;
+            if (b == -1) {
+                result = static_cast<int64_t>(0 - ua);
+                return true;
+            }
+            // The simulator rounds towards negative infinity
+            result = a / b;
+            if ((a % b != 0) && ((a < 0) != (b < 0)))
+                result--;
+            return true;
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sourcefile.hpp"
+
+// Variable 0 of every function is the predefined return variable "_"
+#define IR_RETURN_VARIABLE 0
+#define IR_STRING_LABEL_PREFIX "_str"
+// Start of a function that calls itself as the last thing it does
+#define IR_ENTRY_LABEL_PREFIX "_entry"
+
+enum IRValueType {
+    IR_VALUE_NONE     = 0,
+    IR_VALUE_VARIABLE = 1,
+    IR_VALUE_CONSTANT = 2,
+    // Identifier the parser didn't recognize, passed through to the assembly as written
+    IR_VALUE_SYMBOL   = 3,
+};
+
+struct IRValue {
+    IRValueType type = IR_VALUE_NONE;
+    // Variable id or constant value
+    int64_t value = 0;
+    std::string name;
+
+    [[nodiscard]] static IRValue variable(int id);
+    [[nodiscard]] static IRValue constant(int64_t value);
+    [[nodiscard]] static IRValue symbol(const std::string& name);
+
+    [[nodiscard]] bool isVariable() const {
+        return this->type == IR_VALUE_VARIABLE;
+    }
+    [[nodiscard]] bool isConstant() const {
+        return this->type == IR_VALUE_CONSTANT;
+    }
+    [[nodiscard]] bool operator==(const IRValue& other) const = default;
+    [[nodiscard]] std::string toString() const;
+};
+
+enum IROpcode {
+    IR_MOVE = 0,
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    // if operands[0] <condition> operands[1] goto label
+    IR_BRANCH,
+    IR_JUMP,
+    IR_LABEL,
+    // _ = label(operands...)
+    IR_CALL,
+    // return label(operands...), the callee returns straight to our caller
+    IR_TAIL_CALL,
+    IR_RETURN,
+    // Write the string with data label `label` to stdout
+    IR_PRINT,
+    IR_EXIT,
+    // Raw asm line, operands are substituted into ${N} placeholders in text
+    IR_ASM,
+};
+
+enum IRCondition {
+    IR_CONDITION_EQ = 0,
+    IR_CONDITION_NE,
+    IR_CONDITION_LT,
+    IR_CONDITION_LE,
+    IR_CONDITION_GT,
+    IR_CONDITION_GE,
+};
+
+struct IRInstruction {
+    IROpcode opcode = IR_MOVE;
+    IRValue dst;
+    std::vector<IRValue> operands;
+    IRCondition condition = IR_CONDITION_EQ;
+    std::string label;
+    std::string text;
+    // Labels written by the user can be reached from anywhere, returns at the end of a function keep "_" as it is
+    bool external = false;
+    // Source line this came from in the file of its function, 0 if it isn't known
+    uint32_t line = 0;
+
+    [[nodiscard]] bool isArithmetic() const {
+        return this->opcode >= IR_MOVE && this->opcode <= IR_DIV;
+    }
+    // Division by anything but a known nonzero constant can stop the program
+    [[nodiscard]] bool canFail() const {
+        return this->opcode == IR_DIV && !(this->operands[1].isConstant() && this->operands[1].value != 0);
+    }
+    [[nodiscard]] bool isTerminator() const {
+        return this->opcode == IR_BRANCH || this->opcode == IR_JUMP || this->opcode == IR_TAIL_CALL || this->opcode == IR_RETURN || this->opcode == IR_EXIT;
+    }
+    // Calls the callback with every variable id read by this instruction
+    template<typename F>
+    void forEachUse(F&& callback) const {
+        for (const auto& operand : this->operands) {
+            if (operand.isVariable())
+                callback(static_cast<int>(operand.value));
+        }
+        // Falling off the end of a function hands "_" back to the caller untouched, so a callee may give back whatever
+        // "_" held before the call
+        if ((this->opcode == IR_RETURN && this->external) || this->opcode == IR_CALL || this->opcode == IR_TAIL_CALL)
+            callback(IR_RETURN_VARIABLE);
+    }
+    // Calls the callback with every variable id written by this instruction
+    template<typename F>
+    void forEachDef(F&& callback) const {
+        if (this->dst.isVariable())
+            callback(static_cast<int>(this->dst.value));
+        if (this->opcode == IR_CALL)
+            callback(IR_RETURN_VARIABLE);
+        if (this->opcode == IR_ASM) {
+            for (const auto& operand : this->operands) {
+                if (operand.isVariable())
+                    callback(static_cast<int>(operand.value));
+            }
+        }
+    }
+    // Steps backwards over this instruction, turning the variables live after it into the ones live before it
+    void updateLiveness(std::vector<bool>& live) const {
+        this->forEachDef([&live](int id) {
+            live[id] = false;
+        });
+        this->forEachUse([&live](int id) {
+            live[id] = true;
+        });
+    }
+    [[nodiscard]] std::string toString() const;
+};
+
+struct IRBlock {
+    std::vector<IRInstruction> code;
+    std::vector<int> successors;
+    std::vector<int> predecessors;
+    // Branches to a label outside this function
+    bool exitsToUnknownLabel = false;
+    // Starts with a user label, which may be jumped to from anywhere
+    bool hasUnknownPredecessors = false;
+};
+
+class IRFunction {
+public:
+    IRFunction() = default;
+    IRFunction(std::string name, bool isProcedure);
+
+    std::string name;
+    bool isProcedure = false;
+    // Declared with func inline, every call to it is inlined whatever it costs
+    bool isInline = false;
+    // Where the function is declared, only the file is known for the main code
+    SourcePosition position;
+    int parameterCount = 0;
+    int variableCount = 1;
+    // Symbol table entry of each variable
+    std::vector<int> symbols;
+    // Contents of the strings printed by this function, IR_PRINT refers to them by getStringLabel
+    std::vector<std::string> strings;
+    // Label of each of the strings by its contents, so adding one doesn't have to search them all
+    std::unordered_map<std::string, std::string> stringLabels;
+    // Labels made up by the parser so far, they are numbered per function
+    int labelCount = 0;
+    // Instructions are appended here while parsing, then split into blocks
+    std::vector<IRInstruction> code;
+    std::vector<IRBlock> blocks;
+
+    // Splits the code into basic blocks and links them into a control flow graph
+    void buildBlocks();
+    // Merges the blocks back into a single instruction list
+    void flatten();
+    // Which variables may still be read on exit from each block
+    [[nodiscard]] std::vector<std::vector<bool>> getLiveOut() const;
+    // Adds a variable that doesn't have a name, returns its id
+    int addVariable() {
+        return this->variableCount++;
+    }
+    // Adds a string unless the function already prints the same text, returns its data label
+    std::string addString(std::string contents);
+    // Removes the strings whose label the predicate is true for
+    template<typename F>
+    void removeStrings(F&& predicate) {
+        std::erase_if(this->strings, [this, &predicate](const std::string& str) {
+            const auto label = this->stringLabels.find(str);
+            if (!predicate(label->second))
+                return false;
+            this->stringLabels.erase(label);
+            return true;
+        });
+    }
+    // Label or data name that is unique to this function, named after it so its code is the same wherever it is in the file
+    [[nodiscard]] std::string getLocalName(std::string_view prefix, int number) const;
+    // Labels other code can call or jump to, including the function itself
+    [[nodiscard]] std::vector<std::string> getDefinedLabels() const;
+    // Labels this function calls or jumps to, including any named in raw asm
+    [[nodiscard]] std::vector<std::string> getReferencedLabels() const;
+    [[nodiscard]] std::string toString() const;
+private:
+    template<typename F>
+    void forEachInstruction(F&& callback) const {
+        for (const auto& block : this->blocks) {
+            for (const auto& instr : block.code)
+                callback(instr);
+        }
+        for (const auto& instr : this->code)
+            callback(instr);
+    }
+};
+
+// Strings are named after their contents, so identical text is only stored once whichever functions print it
+[[nodiscard]] std::string getStringLabel(std::string_view contents);
+[[nodiscard]] bool evaluateCondition(IRCondition condition, int64_t a, int64_t b);
+// The condition that holds exactly when the given one doesn't
+[[nodiscard]] IRCondition invertCondition(IRCondition condition);
+[[nodiscard]] bool evaluateArithmetic(IROpcode opcode, int64_t a, int64_t b, int64_t& result);
@@ -0,0 +1,299 @@
+#include "lowering.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+namespace {
+
+IRCondition mirrorCondition(IRCondition condition) {
+    switch (condition) {
+        case IR_CONDITION_LT:
+            return IR_CONDITION_GT;
+        case IR_CONDITION_LE:
+            return IR_CONDITION_GE;
+        case IR_CONDITION_GT:
+            return IR_CONDITION_LT;
+        case IR_CONDITION_GE:
+            return IR_CONDITION_LE;
+        default:
+            return condition;
+    }
+}
+
+Mnemonic getBranchMnemonic(IRCondition condition) {
+    // Conditions are declared in the same order as the branches
+    return static_cast<Mnemonic>(static_cast<int>(MNEMONIC_BEQ) + static_cast<int>(condition));
+}
+
+// Returns n if the value is the constant 2^n, otherwise -1
+int getPowerOfTwo(const IRValue& value) {
+    if (!value.isConstant() || value.value <= 0 || !std::has_single_bit(static_cast<uint64_t>(value.value)))
+        return -1;
+    return std::countr_zero(static_cast<uint64_t>(value.value));
+}
+
+bool isShift(const IRInstruction& instr) {
+    const auto& a = instr.operands[0];
+    const auto& b = instr.operands[1];
+    if (instr.opcode == IR_MUL)
+        return (!a.isConstant() && getPowerOfTwo(b) >= 0) || (getPowerOfTwo(a) >= 0 && !b.isConstant());
+    return instr.opcode == IR_DIV && !a.isConstant() && getPowerOfTwo(b) >= 0;
+}
+
+// Returns the value a branch compares with zero for equality, or nullptr if it does something else
+const IRValue* getZeroTest(const IRInstruction& branch) {
+    if (branch.condition != IR_CONDITION_EQ && branch.condition != IR_CONDITION_NE)
+        return nullptr;
+    const auto& a = branch.operands[0];
+    const auto& b = branch.operands[1];
+    if (a.isVariable() && b == IRValue::constant(0))
+        return &a;
+    if (b.isVariable() && a == IRValue::constant(0))
+        return &b;
+    return nullptr;
+}
+
+} // namespace
+
+Lowering::Lowering(const IRFunction& function_, std::vector<MachineInstruction>& code_, bool optimize_)
+        : function(function_)
+        , code(code_)
+        , optimize(optimize_) {}
+
+int Lowering::run() {
+    // The entry of a function belongs to the line declaring it
+    this->line = this->function.position.line;
+    if (this->function.isProcedure)
+        this->emit(MNEMONIC_LABEL, {MachineOperand::label(this->function.name)});
+    this->emit(MNEMONIC_PROLOGUE);
+
+    // Copy the arguments out of x0-x7, unless the optimizer got rid of every use
+    std::vector<bool> used(this->function.variableCount);
+    for (const auto& block : this->function.blocks) {
+        for (const auto& instr : block.code)
+            instr.forEachUse([&used](int id) {
+                used[id] = true;
+            });
+    }
+    for (int i = 0; i < this->function.parameterCount; i++) {
+        if (used[i + 1])
+            this->emit(MNEMONIC_MOV, {this->getOperand(IRValue::variable(i + 1)), MachineOperand::reg(i)});
+    }
+
+    const auto liveOut = this->optimize ? this->function.getLiveOut() : std::vector<std::vector<bool>>{};
+    for (int i = 0; i < this->function.blocks.size(); i++) {
+        const auto& block = this->function.blocks[i];
+        const auto fused = this->optimize ? this->findMultiplyAccumulates(block, liveOut[i]) : std::vector<bool>(block.code.size());
+        const bool select = this->optimize && this->isSelect(i);
+        for (int j = 0; j < block.code.size(); j++) {
+            this->line = block.code[j].line;
+            if (fused[j])
+                continue;
+            if (select && j + 1 == block.code.size())
+                this->lowerSelect(block.code[j], this->function.blocks[i + 1].code[0]);
+            else if (j > 0 && fused[j - 1])
+                this->lowerMultiplyAccumulate(block.code[j - 1], block.code[j]);
+            else if (this->optimize && isShift(block.code[j]))
+                this->lowerShift(block.code[j]);
+            else
+                this->lower(block.code[j]);
+        }
+        // The assignment the branch went around has been done already
+        if (select)
+            i++;
+    }
+    // Temporaries are numbered after the variables, "_" is not virtual
+    return this->function.variableCount - 1 + this->temporaryCount;
+}
+
+void Lowering::lower(const IRInstruction& instr) {
+    switch (instr.opcode) {
+        case IR_MOVE:
+            this->emit(MNEMONIC_MOV, {this->getOperand(instr.dst), this->getOperand(instr.operands[0])});
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV: {
+            static constexpr Mnemonic mnemonics[] = {MNEMONIC_MOV, MNEMONIC_ADD, MNEMONIC_SUB, MNEMONIC_MUL, MNEMONIC_SDIV};
+            auto a = instr.operands[0], b = instr.operands[1];
+            // add and sub only take an immediate as their last operand, mul and sdiv never do
+            if (instr.opcode == IR_ADD && a.isConstant() && !b.isConstant())
+                std::swap(a, b);
+            auto first = this->getRegisterOperand(a);
+            auto second = instr.opcode == IR_ADD || instr.opcode == IR_SUB ? this->getOperand(b) : this->getRegisterOperand(b);
+            this->emit(mnemonics[instr.opcode], {this->getOperand(instr.dst), first, second});
+            break;
+        }
+        case IR_BRANCH: {
+            // Testing for zero is a single instruction that doesn't need the flags
+            if (const auto* value = getZeroTest(instr); value && this->optimize) {
+                this->emit(instr.condition == IR_CONDITION_EQ ? MNEMONIC_CBZ : MNEMONIC_CBNZ, {this->getOperand(*value), MachineOperand::label(instr.label)});
+                break;
+            }
+            const auto condition = this->lowerCompare(instr);
+            this->emit(getBranchMnemonic(condition), {MachineOperand::label(instr.label)});
+            break;
+        }
+        case IR_JUMP:
+            this->emit(MNEMONIC_B, {MachineOperand::label(instr.label)});
+            break;
+        case IR_LABEL:
+            this->emit(MNEMONIC_LABEL, {MachineOperand::label(instr.label)});
+            break;
+        case IR_CALL:
+        case IR_TAIL_CALL:
+            // Copy all arguments to x0-x7, live registers are saved around the call once they have been allocated
+            for (int i = 0; i < instr.operands.size(); i++)
+                this->emit(MNEMONIC_MOV, {MachineOperand::reg(i), this->getOperand(instr.operands[i])});
+            this->emit(instr.opcode == IR_CALL ? MNEMONIC_CALL : MNEMONIC_TAIL_CALL, {MachineOperand::label(instr.label)});
+            break;
+        case IR_RETURN:
+            if (!instr.operands.empty())
+                this->emit(MNEMONIC_MOV, {MachineOperand::reg(ASM_REGISTER_RETURN_VALUE), this->getOperand(instr.operands[0])});
+            else if (!instr.external)
+                this->emit(MNEMONIC_MOV, {MachineOperand::reg(ASM_REGISTER_RETURN_VALUE), MachineOperand::imm(0)});
+            this->emit(MNEMONIC_RETURN);
+            break;
+        case IR_PRINT: {
+            const auto& str = instr.label;
+            this->emit(MNEMONIC_MOV, {MachineOperand::reg(0), MachineOperand::imm(1)});
+            this->emit(MNEMONIC_LDR, {MachineOperand::reg(1), MachineOperand::symbol(str)});
+            this->emit(MNEMONIC_LDR, {MachineOperand::reg(2), MachineOperand::symbol(str + "_len")});
+            this->emit(MNEMONIC_MOV, {MachineOperand::reg(8), MachineOperand::imm(ASM_SYSCALL_WRITE)});
+            this->emit(MNEMONIC_SVC, {MachineOperand::imm(0)});
+            break;
+        }
+        case IR_EXIT:
+            if (!instr.operands.empty())
+                this->emit(MNEMONIC_MOV, {MachineOperand::reg(0), this->getOperand(instr.operands[0])});
+            this->emit(MNEMONIC_MOV, {MachineOperand::reg(8), MachineOperand::imm(ASM_SYSCALL_EXIT)});
+            this->emit(MNEMONIC_SVC, {MachineOperand::imm(0)});
+            break;
+        case IR_ASM: {
+            MachineInstruction raw{MNEMONIC_RAW};
+            raw.text = instr.text;
+            for (const auto& operand : instr.operands)
+                raw.operands.push_back(this->getOperand(operand));
+            this->code.push_back(std::move(raw));
+            break;
+        }
+    }
+}
+
+IRCondition Lowering::lowerCompare(const IRInstruction& branch) {
+    auto a = branch.operands[0], b = branch.operands[1];
+    auto condition = branch.condition;
+    if (a.isConstant() && !b.isConstant()) {
+        std::swap(a, b);
+        condition = mirrorCondition(condition);
+    }
+    auto first = this->getRegisterOperand(a);
+    this->emit(MNEMONIC_CMP, {first, this->getOperand(b)});
+    return condition;
+}
+
+bool Lowering::isSelect(int block) const {
+    const auto& blocks = this->function.blocks;
+    if (block + 2 >= blocks.size() || blocks[block].code.empty() || blocks[block].code.back().opcode != IR_BRANCH)
+        return false;
+    const auto& branch = blocks[block].code.back();
+    const auto& body = blocks[block + 1];
+    const auto& next = blocks[block + 2].code;
+    if (body.code.size() != 1 || body.predecessors.size() != 1 || body.hasUnknownPredecessors || next.empty() || next[0].opcode != IR_LABEL || next[0].label != branch.label)
+        return false;
+    // The assignment is done whether the branch is taken or not, so it mustn't be able to stop the program
+    const auto& assignment = body.code[0];
+    return assignment.isArithmetic() && !assignment.canFail() && std::none_of(assignment.operands.begin(), assignment.operands.end(), [](const IRValue& operand) {
+        return operand.type == IR_VALUE_SYMBOL;
+    });
+}
+
+void Lowering::lowerSelect(const IRInstruction& branch, const IRInstruction& assignment) {
+    auto value = this->getOperand(assignment.operands[0]);
+    if (assignment.opcode != IR_MOVE || !assignment.operands[0].isVariable()) {
+        // Whatever is written last is the result, it goes into a temporary instead of the variable
+        this->line = assignment.line;
+        if (isShift(assignment))
+            this->lowerShift(assignment);
+        else
+            this->lower(assignment);
+        value = this->addTemporary();
+        this->code.back().operands[0] = value;
+        this->line = branch.line;
+    }
+    const auto dst = this->getOperand(assignment.dst);
+    // The branch went around the assignment when its condition held, so that keeps the old value
+    const auto condition = this->lowerCompare(branch);
+    this->emit(MNEMONIC_CSEL, {dst, dst, value, MachineOperand::condition(getBranchMnemonic(condition))});
+}
+
+std::vector<bool> Lowering::findMultiplyAccumulates(const IRBlock& block, std::vector<bool> live) const {
+    std::vector<bool> fused(block.code.size());
+    for (int j = static_cast<int>(block.code.size()) - 1; j > 0; j--) {
+        // live holds the variables read after instruction j
+        const auto& multiply = block.code[j - 1];
+        const auto& instr = block.code[j];
+        if (multiply.opcode == IR_MUL && !isShift(multiply) && (instr.opcode == IR_ADD || instr.opcode == IR_SUB)) {
+            const auto& product = multiply.dst;
+            // msub can only take the product away from the other operand, not the other way around
+            const bool usesProduct = instr.opcode == IR_ADD ? (instr.operands[0] == product) != (instr.operands[1] == product)
+                                                            : instr.operands[1] == product && instr.operands[0] != product;
+            // The multiply's operands are read at the add instead, which is fine since only the product was written in between
+            if (usesProduct && (!live[product.value] || instr.dst == product))
+                fused[j - 1] = true;
+        }
+        instr.updateLiveness(live);
+    }
+    return fused;
+}
+
+void Lowering::lowerMultiplyAccumulate(const IRInstruction& multiply, const IRInstruction& instr) {
+    const auto& addend = instr.opcode == IR_SUB || instr.operands[1] == multiply.dst ? instr.operands[0] : instr.operands[1];
+    auto first = this->getRegisterOperand(multiply.operands[0]);
+    auto second = this->getRegisterOperand(multiply.operands[1]);
+    auto third = this->getRegisterOperand(addend);
+    this->emit(instr.opcode == IR_ADD ? MNEMONIC_MADD : MNEMONIC_MSUB, {this->getOperand(instr.dst), first, second, third});
+}
+
+void Lowering::lowerShift(const IRInstruction& instr) {
+    auto a = instr.operands[0], b = instr.operands[1];
+    if (a.isConstant())
+        std::swap(a, b);
+    const int shift = getPowerOfTwo(b);
+    if (shift == 0) {
+        this->emit(MNEMONIC_MOV, {this->getOperand(instr.dst), this->getOperand(a)});
+        return;
+    }
+    // The simulator rounds division towards negative infinity, which is exactly what an arithmetic shift does
+    this->emit(instr.opcode == IR_MUL ? MNEMONIC_LSL : MNEMONIC_ASR, {this->getOperand(instr.dst), this->getOperand(a), MachineOperand::imm(shift)});
+}
+
+MachineOperand Lowering::getOperand(const IRValue& value) const {
+    switch (value.type) {
+        case IR_VALUE_VARIABLE:
+            if (value.value == IR_RETURN_VARIABLE)
+                return MachineOperand::reg(ASM_REGISTER_RETURN_VALUE);
+            return MachineOperand::virt(static_cast<int>(value.value) - 1);
+        case IR_VALUE_CONSTANT:
+            return MachineOperand::imm(value.value);
+        case IR_VALUE_SYMBOL:
+            return MachineOperand::label(value.name);
+        case IR_VALUE_NONE:
+            break;
+    }
+    return {};
+}
+
+MachineOperand Lowering::getRegisterOperand(const IRValue& value) {
+    if (!value.isConstant())
+        return this->getOperand(value);
+    auto temporary = this->addTemporary();
+    this->emit(MNEMONIC_MOV, {temporary, MachineOperand::imm(value.value)});
+    return temporary;
+}
+
+MachineOperand Lowering::addTemporary() {
+    return MachineOperand::virt(this->function.variableCount - 1 + this->temporaryCount++);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+
+#include "instruction.hpp"
+#include "ir.hpp"
+
+// There is a predefined return variable "_"
+#define ASM_REGISTER_RETURN_VALUE 10
+#define ASM_SYSCALL_WRITE 0x40
+#define ASM_SYSCALL_EXIT 93
+
+class Lowering {
+public:
+    // Optimizing replaces arithmetic with cheaper or combined instructions where it can
+    Lowering(const IRFunction& function, std::vector<MachineInstruction>& code, bool optimize = false);
+    // Selects AArch64 instructions for the IR, returns how many virtual registers they use
+    int run();
+private:
+    const IRFunction& function;
+    std::vector<MachineInstruction>& code;
+    bool optimize;
+    int temporaryCount = 0;
+    // Source line of the instruction being lowered
+    uint32_t line = 0;
+
+    inline void emit(Mnemonic mnemonic, std::vector<MachineOperand> operands = {}) {
+        this->code.emplace_back(mnemonic, std::move(operands)).line = this->line;
+    }
+    void lower(const IRInstruction& instr);
+    // Compares the operands of a branch, returns the condition to test once they have been swapped for cmp
+    IRCondition lowerCompare(const IRInstruction& branch);
+    // True if the block ends with a branch around a single assignment that is safe to do either way
+    [[nodiscard]] bool isSelect(int block) const;
+    // Does the assignment into a temporary, then keeps either it or the old value with csel instead of branching
+    void lowerSelect(const IRInstruction& branch, const IRInstruction& assignment);
+    // Finds multiplies whose only use is the add or sub right after them
+    [[nodiscard]] std::vector<bool> findMultiplyAccumulates(const IRBlock& block, std::vector<bool> live) const;
+    // Lowers an add or sub together with the multiply feeding it
+    void lowerMultiplyAccumulate(const IRInstruction& multiply, const IRInstruction& instr);
+    // Lowers a multiply or divide by a power of two
+    void lowerShift(const IRInstruction& instr);
+    [[nodiscard]] MachineOperand getOperand(const IRValue& value) const;
+    // Like getOperand, but constants are first moved into a temporary register
+    [[nodiscard]] MachineOperand getRegisterOperand(const IRValue& value);
+    [[nodiscard]] MachineOperand addTemporary();
+};
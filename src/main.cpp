@@ -1,36 +1,414 @@
-#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "parser.hpp"
+#include "server.hpp"
+#include "simulator.hpp"
+
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#define ARMCOMP_HAS_RUSAGE
+#endif
+
+// Directories are searched for files with this extension
+#define ARMCOMP_SOURCE_EXTENSION ".arm"
+// Where compiled functions are kept if --cache isn't given a directory
+#define ARMCOMP_DEFAULT_CACHE_DIRECTORY ".armcomp_cache"
+
+struct CompilerOptions {
+    ParserOptions parser;
+    bool simulate = true;
+    // Reports how many instructions each source line and function ran
+    bool profile = false;
+    // 0 uses one worker per core
+    int jobs = 0;
+    // Socket of a compile server to send files to instead of compiling them here
+    std::string server;
+    // Reports how long each phase took and what was generated, as JSON if statsJson is set
+    bool stats = false;
+    bool statsJson = false;
+};
+
+// Everything --stats reports about one file
+struct FileStats {
+    ParserStats parser;
+    double writeMilliseconds = 0;
+    double simulateMilliseconds = 0;
+    uint64_t executedInstructions = 0;
+};
 
 std::string replaceExtension(const std::string& filename, const std::string& ext) {
     return filename.substr(0, filename.find_last_of('.')) + "." + ext;
 }
 
-int main(int argc, const char* argv[]) {
-    if (argc < 2) {
-        std::cout << "No file was provided!" << '\n';
-        return 1;
+// Sums the executed instruction counts of every line by source line and by function, hottest first
+void writeProfile(std::ostream& out, const SourceMap& sourceMap, const std::vector<std::pair<uint32_t, uint64_t>>& profile) {
+    std::unordered_map<std::string, uint64_t> lineCounts;
+    std::unordered_map<std::string, uint64_t> functionCounts;
+    uint64_t total = 0;
+    for (const auto& [assemblyLine, count] : profile) {
+        total += count;
+        if (const auto* entry = sourceMap.find(assemblyLine)) {
+            lineCounts[std::string{entry->position.file} + ':' + std::to_string(entry->position.line)] += count;
+            functionCounts[std::string{sourceMap.getFunctionName(entry->function)}] += count;
+        } else {
+            lineCounts["<unknown>"] += count;
+            functionCounts["<unknown>"] += count;
+        }
     }
 
-    std::cout << "Transpiling \"" << argv[1] << "\"...\n";
-    Parser parser{argv[1]};
-    auto response = parser.parse();
-    if (!response.empty()) {
-        std::cout << response << '\n';
-        return 1;
+    const auto writeSorted = [&out, total](const std::unordered_map<std::string, uint64_t>& counts) {
+        std::vector<std::pair<std::string, uint64_t>> sorted{counts.begin(), counts.end()};
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        for (const auto& [name, count] : sorted)
+            out << std::setw(12) << count << std::setw(8) << std::fixed << std::setprecision(2) << static_cast<double>(count) * 100 / static_cast<double>(total) << "%  " << name << '\n';
+    };
+    out << "\nExecuted " << total << " instructions\n\nBy line:\n";
+    writeSorted(lineCounts);
+    out << "\nBy function:\n";
+    writeSorted(functionCounts);
+}
+
+double getMilliseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Peak resident memory of the whole process in kilobytes, 0 if the platform can't tell
+long getPeakMemoryKilobytes() {
+#ifdef ARMCOMP_HAS_RUSAGE
+    rusage usage{};
+    if (::getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+std::string escapeJson(std::string_view text) {
+    std::string escaped;
+    for (const char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            static constexpr char digits[] = "0123456789abcdef";
+            escaped += "\\u00";
+            escaped += digits[c >> 4];
+            escaped += digits[c & 0xF];
+        } else {
+            escaped += c;
+        }
     }
+    return escaped;
+}
 
-    std::string outFile = replaceExtension(argv[1], "s");
-    if (outFile == argv[1])
-        outFile = replaceExtension(argv[1], "compiled.s");
-    std::cout << "Saving to \"" << outFile << "\"\n";
+void writeStats(std::ostream& out, const std::string& file, const FileStats& stats, bool json) {
+    const auto& parser = stats.parser;
+    const auto peakMemory = getPeakMemoryKilobytes();
+    const auto savesPerCall = parser.callSites > 0 ? static_cast<double>(parser.callerSaves) / static_cast<double>(parser.callSites) : 0.0;
+    out << std::fixed << std::setprecision(3);
+    if (json) {
+        out << "{\"file\":\"" << escapeJson(file) << '"'
+            << ",\"milliseconds\":{\"read\":" << parser.readMilliseconds << ",\"parse\":" << parser.parseMilliseconds
+            << ",\"optimize\":" << parser.optimizeMilliseconds << ",\"emit\":" << parser.emitMilliseconds
+            << ",\"write\":" << stats.writeMilliseconds << ",\"simulate\":" << stats.simulateMilliseconds << '}'
+            << ",\"peakMemoryKilobytes\":" << peakMemory
+            << ",\"sourceLines\":" << parser.sourceLines
+            << ",\"instructions\":{\"code\":" << parser.codeInstructions << ",\"procedures\":" << parser.procedureInstructions << '}'
+            << ",\"labels\":" << parser.labels
+            << ",\"strings\":" << parser.strings << ",\"stringBytes\":" << parser.stringBytes
+            << ",\"spilledRegisters\":" << parser.spilledRegisters << ",\"spillInstructions\":" << parser.spillInstructions
+            << ",\"callSites\":" << parser.callSites << ",\"callerSaves\":" << parser.callerSaves << ",\"savesPerCall\":" << savesPerCall
+            << ",\"executedInstructions\":" << stats.executedInstructions << "}\n";
+        return;
+    }
+    const auto row = [&out](std::string_view name) -> std::ostream& {
+        return out << "  " << std::left << std::setw(22) << name << std::right;
+    };
+    out << "\nStats for \"" << file << "\":\n";
+    row("Read") << std::setw(12) << parser.readMilliseconds << " ms\n";
+    row("Parse") << std::setw(12) << parser.parseMilliseconds << " ms\n";
+    row("Optimize") << std::setw(12) << parser.optimizeMilliseconds << " ms\n";
+    row("Emit") << std::setw(12) << parser.emitMilliseconds << " ms\n";
+    row("Write") << std::setw(12) << stats.writeMilliseconds << " ms\n";
+    row("Simulate") << std::setw(12) << stats.simulateMilliseconds << " ms\n";
+    row("Peak memory") << std::setw(12) << peakMemory << " KB\n";
+    row("Source lines") << std::setw(12) << parser.sourceLines << '\n';
+    row("Code instructions") << std::setw(12) << parser.codeInstructions << '\n';
+    row("Procedure instructions") << std::setw(12) << parser.procedureInstructions << '\n';
+    row("Labels") << std::setw(12) << parser.labels << '\n';
+    row("Strings") << std::setw(12) << parser.strings << " (" << parser.stringBytes << " bytes)\n";
+    row("Spilled registers") << std::setw(12) << parser.spilledRegisters << " (" << parser.spillInstructions << " loads and stores)\n";
+    row("Call sites") << std::setw(12) << parser.callSites << " (" << std::setprecision(2) << savesPerCall << " saves per call)\n";
+    row("Executed instructions") << std::setw(12) << stats.executedInstructions << '\n';
+}
+
+struct CacheCounters {
+    std::atomic<int> hits = 0;
+    std::atomic<int> misses = 0;
+};
+
+// Parses a file and reports what the optimizers did
+std::string transpile(Parser& parser, const ParserOptions& options, std::ostream& log, CacheCounters& cacheCounters) {
+    if (auto error = parser.parse(); !error.empty())
+        return error;
+    if (options.optimizationLevel >= 1) {
+        log << "IR optimizer removed " << parser.getOptimizerRemovedCount() << " instructions\n";
+        log << "Peephole optimizer removed " << parser.getPeepholeRemovedCount() << " instructions\n";
+        log << "Inlined " << parser.getInlinedCallCount() << " calls\n";
+        log << "Evaluated " << parser.getEvaluatedCallCount() << " calls while compiling\n";
+        log << "Removed " << parser.getRemovedFunctionCount() << " unused functions\n";
+    }
+    if (options.cache) {
+        log << "Function cache: " << parser.getCacheHitCount() << " hits, " << parser.getCacheMissCount() << " misses\n";
+        cacheCounters.hits += parser.getCacheHitCount();
+        cacheCounters.misses += parser.getCacheMissCount();
+    }
+    return "";
+}
+
+// Compiles a file and optionally runs it, exitCode is set to whatever the program exited with
+std::string compileFile(const std::string& inFile, const CompilerOptions& options, std::ostream& log, std::ostream& programOutput, std::istream& programInput, int& exitCode, CacheCounters& cacheCounters) {
+    exitCode = 0;
+    log << "Transpiling \"" << inFile << "\"...\n";
+    // The file is compiled by one of these, the assembly is a view into it
+    std::unique_ptr<Parser> parser;
+    CompileResponse response;
+    std::string_view assembly;
+    if (!options.server.empty()) {
+        std::ifstream file{inFile, std::ios::in | std::ios::binary};
+        if (!file.is_open())
+            return "Error reading file!";
+        const CompileRequest request{inFile, {std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}}, options.parser};
+        if (auto error = requestCompile(options.server, request, response); !error.empty())
+            return error;
+        log << response.log;
+        if (!response.error.empty())
+            return response.error;
+        assembly = response.assembly;
+    } else {
+        parser = std::make_unique<Parser>(inFile, options.parser);
+        if (auto error = transpile(*parser, options.parser, log, cacheCounters); !error.empty())
+            return error;
+        assembly = parser->getAssembly();
+    }
+
+    FileStats stats;
+    if (parser)
+        stats.parser = parser->getStats();
+    auto phaseStart = std::chrono::steady_clock::now();
+    std::string outFile = replaceExtension(inFile, "s");
+    if (outFile == inFile)
+        outFile = replaceExtension(inFile, "compiled.s");
+    log << "Saving to \"" << outFile << "\"\n";
     std::fstream out{outFile, std::ios::out};
-    std::string assembly = parser.getAssembly();
-    out.write(assembly.c_str(), static_cast<int64_t>(assembly.length()));
+    out.write(assembly.data(), static_cast<std::streamsize>(assembly.length()));
     out.close();
+    if (options.parser.sourceMap) {
+        const auto mapFile = outFile + ".map";
+        log << "Saving source map to \"" << mapFile << "\"\n";
+        std::fstream map{mapFile, std::ios::out};
+        map << (parser ? parser->getSourceMap().toString() : response.sourceMap);
+    }
+    stats.writeMilliseconds = getMilliseconds(phaseStart);
 
-    std::cout << "Running in simulator...\n\n";
-    std::string pycall = "python armsim_runner.py \"" + outFile + '\"';
-    return system(pycall.c_str());
+    if (options.simulate) {
+        log << "Running in simulator...\n\n";
+        phaseStart = std::chrono::steady_clock::now();
+        Simulator simulator{programOutput, programInput};
+        simulator.setProfiling(options.profile);
+        if (auto error = simulator.load(assembly); !error.empty())
+            return error;
+        if (auto error = simulator.run(); !error.empty())
+            return error;
+        stats.simulateMilliseconds = getMilliseconds(phaseStart);
+        stats.executedInstructions = simulator.getExecutedCount();
+        programOutput << simulator.getRegisterDump();
+        if (options.profile)
+            writeProfile(log, parser->getSourceMap(), simulator.getProfile());
+        exitCode = simulator.getExitCode();
+    }
+    if (options.stats)
+        writeStats(log, inFile, stats, options.statsJson);
+    return "";
+}
+
+// Compiles every file on a pool of workers, returns 1 if any of them failed
+int compileBatch(const std::vector<std::string>& inFiles, const CompilerOptions& options) {
+    const auto cores = static_cast<int>(std::thread::hardware_concurrency());
+    const int workerCount = std::clamp(options.jobs > 0 ? options.jobs : cores, 1, static_cast<int>(inFiles.size()));
+    std::cout << "Compiling " << inFiles.size() << " files with " << workerCount << " workers...\n";
+
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<std::size_t> next = 0;
+    std::atomic<int> failed = 0;
+    std::atomic<int64_t> totalMicroseconds = 0;
+    CacheCounters cacheCounters;
+    std::mutex outputMutex;
+
+    const auto work = [&] {
+        for (auto i = next++; i < inFiles.size(); i = next++) {
+            const auto fileStart = std::chrono::steady_clock::now();
+            // Reports are buffered so the output of each file stays together
+            std::ostringstream log;
+            std::istringstream input;
+            int exitCode;
+            // A program can exit with whatever it likes, only a failure to compile or simulate counts
+            const auto error = compileFile(inFiles[i], options, log, log, input, exitCode, cacheCounters);
+            const auto milliseconds = getMilliseconds(fileStart);
+            if (!error.empty()) {
+                log << error << '\n';
+                failed++;
+            } else if (options.simulate) {
+                log << "\nExit code " << exitCode << '\n';
+            }
+            totalMicroseconds += static_cast<int64_t>(milliseconds * 1000);
+
+            std::lock_guard lock{outputMutex};
+            std::cout << log.str() << (error.empty() ? "Finished" : "Failed") << " \"" << inFiles[i] << "\" in " << std::fixed << std::setprecision(2) << milliseconds << " ms\n\n";
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < workerCount; i++)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Compiled " << inFiles.size() - failed << '/' << inFiles.size() << " files in " << getMilliseconds(start) << " ms"
+              << " (" << static_cast<double>(totalMicroseconds) / 1000 << " ms across all files)\n";
+    if (options.parser.cache)
+        std::cout << "Function cache: " << cacheCounters.hits << " hits, " << cacheCounters.misses << " misses\n";
+    return failed > 0 ? 1 : 0;
+}
+
+// Compiles files sent by clients until the process is stopped, they all share one cache
+int serve(const std::string& socketPath, const FunctionCache& cache) {
+    std::mutex outputMutex;
+    CompileServer server{socketPath, [&cache, &outputMutex](const CompileRequest& request, CompileResponse& response) {
+        const auto start = std::chrono::steady_clock::now();
+        auto options = request.options;
+        options.cache = &cache;
+        Parser parser{request.path, request.source, options};
+        std::ostringstream log;
+        CacheCounters cacheCounters;
+        response.error = transpile(parser, options, log, cacheCounters);
+        response.log = log.str();
+        if (response.error.empty()) {
+            response.assembly = parser.getAssembly();
+            if (options.sourceMap)
+                response.sourceMap = parser.getSourceMap().toString();
+        }
+
+        std::lock_guard lock{outputMutex};
+        std::cout << (response.error.empty() ? "Compiled" : "Failed") << " \"" << request.path << "\" in "
+                  << std::fixed << std::setprecision(2) << getMilliseconds(start) << " ms" << std::endl;
+    }};
+    std::cout << "Listening on \"" << socketPath << "\"..." << std::endl;
+    std::cout << server.run() << '\n';
+    return 1;
+}
+
+int main(int argc, const char* argv[]) {
+    std::vector<std::string> inFiles;
+    bool batch = false;
+    std::string serverSocket;
+    CompilerOptions options;
+    std::unique_ptr<FunctionCache> cache;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.starts_with("-O") && arg.length() == 3 && std::isdigit(arg[2])) {
+            options.parser.optimizationLevel = arg[2] - '0';
+        } else if (arg.starts_with("-j") && arg.length() > 2 && std::all_of(arg.begin() + 2, arg.end(), [](char c) { return std::isdigit(c); })) {
+            options.jobs = std::stoi(arg.substr(2));
+        } else if (arg == "--no-sim") {
+            options.simulate = false;
+        } else if (arg == "--source-map") {
+            options.parser.sourceMap = true;
+        } else if (arg == "--profile") {
+            options.parser.sourceMap = true;
+            options.profile = true;
+        } else if (arg == "--stats" || arg == "--stats=json") {
+            options.stats = true;
+            options.statsJson = arg == "--stats=json";
+        } else if (arg.starts_with("--target=")) {
+            const auto target = arg.substr(9);
+            if (target == "aarch64-linux") {
+                options.parser.target = TARGET_AARCH64;
+            } else if (target == "x86_64-linux") {
+                // The simulator only runs AArch64, assemble the output with as and ld instead
+                options.parser.target = TARGET_X86_64;
+                options.simulate = false;
+            } else {
+                std::cout << "Unknown target \"" << target << "\"\n";
+                return 1;
+            }
+        } else if (arg == "--server" || arg.starts_with("--server=")) {
+            serverSocket = arg == "--server" ? ARMCOMP_DEFAULT_SOCKET : arg.substr(9);
+        } else if (arg == "--client" || arg.starts_with("--client=")) {
+            options.server = arg == "--client" ? ARMCOMP_DEFAULT_SOCKET : arg.substr(9);
+        } else if (arg == "--cache" || arg.starts_with("--cache=")) {
+            cache = std::make_unique<FunctionCache>(arg == "--cache" ? ARMCOMP_DEFAULT_CACHE_DIRECTORY : arg.substr(8));
+            options.parser.cache = cache.get();
+        } else if (arg.starts_with('-')) {
+            std::cout << "Unknown option \"" << arg << "\"\n";
+            return 1;
+        } else if (std::filesystem::is_directory(arg)) {
+            // Sorted so batches always run in the same order
+            std::vector<std::string> found;
+            for (const auto& entry : std::filesystem::recursive_directory_iterator{arg}) {
+                if (entry.is_regular_file() && entry.path().extension() == ARMCOMP_SOURCE_EXTENSION)
+                    found.push_back(entry.path().string());
+            }
+            std::sort(found.begin(), found.end());
+            inFiles.insert(inFiles.end(), found.begin(), found.end());
+            batch = true;
+        } else {
+            inFiles.push_back(arg);
+        }
+    }
+
+    if (!serverSocket.empty()) {
+        // Functions only stay warm between requests if there is a cache to keep them in
+        if (!cache)
+            cache = std::make_unique<FunctionCache>("");
+        return serve(serverSocket, *cache);
+    }
+    if (inFiles.empty()) {
+        std::cout << "No file was provided!" << '\n';
+        return 1;
+    }
+    if (options.profile && !options.server.empty()) {
+        std::cout << "--profile needs the source map, which is only kept when compiling without --client" << '\n';
+        return 1;
+    }
+    if (options.stats && !options.server.empty()) {
+        std::cout << "--stats measures the compiler as it runs, which can't be done with --client" << '\n';
+        return 1;
+    }
+
+    if (batch || inFiles.size() > 1)
+        return compileBatch(inFiles, options);
+    int exitCode;
+    CacheCounters cacheCounters;
+    if (auto error = compileFile(inFiles[0], options, std::cout, std::cout, std::cin, exitCode, cacheCounters); !error.empty()) {
+        std::cout << std::flush << error << '\n';
+        return 1;
+    }
+    return exitCode;
 }
@@ -0,0 +1,564 @@
+#include "optimizer.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+// Every pass can expose more work for the others, but a few rounds catch nearly all of it
+#define IR_OPTIMIZER_MAX_ROUNDS 8
+// Prints are only merged while the string they write stays this short, so long runs of them can't build huge strings
+#define IR_OPTIMIZER_MAX_PRINT_LENGTH 4096
+
+namespace {
+
+enum LatticeKind {
+    // No definition reaches this point yet
+    LATTICE_UNDEFINED = 0,
+    LATTICE_CONSTANT,
+    LATTICE_VARYING,
+};
+
+struct LatticeValue {
+    LatticeKind kind = LATTICE_UNDEFINED;
+    int64_t value = 0;
+
+    [[nodiscard]] bool operator==(const LatticeValue& other) const = default;
+};
+
+// Solves a forward dataflow problem, returns the state on entry to each block (empty if the block is never reached)
+template<typename State, typename Meet, typename Transfer>
+std::vector<std::optional<State>> solveForward(const IRFunction& function, const State& unknown, Meet meet, Transfer transfer) {
+    const auto& blocks = function.blocks;
+    std::vector<std::optional<State>> in(blocks.size()), out(blocks.size());
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < blocks.size(); i++) {
+            std::optional<State> state;
+            if (i == 0 || blocks[i].hasUnknownPredecessors) {
+                state = unknown;
+            } else {
+                for (int predecessor : blocks[i].predecessors) {
+                    if (!out[predecessor])
+                        continue;
+                    if (!state)
+                        state = out[predecessor];
+                    else
+                        meet(*state, *out[predecessor], i);
+                }
+            }
+            if (!state || (out[i] && in[i] == state))
+                continue;
+            in[i] = state;
+            for (const auto& instr : blocks[i].code)
+                transfer(instr, *state);
+            if (out[i] != state) {
+                out[i] = std::move(state);
+                changed = true;
+            }
+        }
+    }
+    return in;
+}
+
+LatticeValue evaluateLattice(const IRValue& value, const std::vector<LatticeValue>& state) {
+    if (value.isConstant())
+        return {LATTICE_CONSTANT, value.value};
+    if (value.isVariable())
+        return state[value.value];
+    return {LATTICE_VARYING};
+}
+
+void meetConstants(std::vector<LatticeValue>& state, const std::vector<LatticeValue>& other, int) {
+    for (int i = 0; i < state.size(); i++) {
+        if (other[i].kind == LATTICE_UNDEFINED || state[i] == other[i])
+            continue;
+        state[i] = state[i].kind == LATTICE_UNDEFINED ? other[i] : LatticeValue{LATTICE_VARYING};
+    }
+}
+
+void transferConstants(const IRInstruction& instr, std::vector<LatticeValue>& state) {
+    if (!instr.isArithmetic()) {
+        instr.forEachDef([&state](int id) {
+            state[id] = {LATTICE_VARYING};
+        });
+        return;
+    }
+    auto result = evaluateLattice(instr.operands[0], state);
+    if (instr.opcode != IR_MOVE) {
+        const auto other = evaluateLattice(instr.operands[1], state);
+        if (result.kind == LATTICE_VARYING || other.kind == LATTICE_VARYING)
+            result = {LATTICE_VARYING};
+        else if (result.kind == LATTICE_UNDEFINED || other.kind == LATTICE_UNDEFINED)
+            result = {LATTICE_UNDEFINED};
+        else if (int64_t value; evaluateArithmetic(instr.opcode, result.value, other.value, value))
+            result = {LATTICE_CONSTANT, value};
+        else
+            result = {LATTICE_VARYING};
+    }
+    state[instr.dst.value] = result;
+}
+
+struct CopyState {
+    // Identifies the definition currently reaching each variable
+    std::vector<int64_t> definitions;
+    // Which variable each one is a copy of (or -1), and the definition of it that was copied
+    std::vector<std::pair<int, int64_t>> copies;
+
+    [[nodiscard]] bool operator==(const CopyState& other) const = default;
+
+    // Redefining a variable doesn't have to find every copy of it, a copy is only valid while its source still has the copied definition
+    [[nodiscard]] int getSource(int variable) const {
+        const auto [source, definition] = this->copies[variable];
+        return source >= 0 && this->definitions[source] == definition ? source : -1;
+    }
+};
+
+// Definitions that meet at the start of a block are replaced by one that is unique to that block and variable
+int64_t getMergedDefinition(int block, int variable, int variableCount) {
+    return -1 - (static_cast<int64_t>(block) * variableCount + variable);
+}
+
+void meetCopies(CopyState& state, const CopyState& other, int block) {
+    const auto variableCount = static_cast<int>(state.definitions.size());
+    for (int i = 0; i < variableCount; i++) {
+        if (state.definitions[i] != other.definitions[i])
+            state.definitions[i] = getMergedDefinition(block, i, variableCount);
+        if (state.copies[i] != other.copies[i])
+            state.copies[i] = {-1, 0};
+    }
+}
+
+void transferCopies(const IRInstruction& instr, CopyState& state) {
+    // Instructions don't move while the analysis runs, so their address identifies the definitions they make
+    const auto definition = static_cast<int64_t>(reinterpret_cast<std::intptr_t>(&instr));
+    instr.forEachDef([&state, definition](int id) {
+        state.definitions[id] = definition;
+        state.copies[id] = {-1, 0};
+    });
+    if (instr.opcode == IR_MOVE && instr.operands[0].isVariable() && instr.operands[0].value != instr.dst.value) {
+        const auto source = static_cast<int>(instr.operands[0].value);
+        state.copies[instr.dst.value] = {source, state.definitions[source]};
+    }
+}
+
+std::vector<bool> getLiveIn(const IRBlock& block, std::vector<bool> live) {
+    for (auto instr = block.code.rbegin(); instr != block.code.rend(); ++instr)
+        instr->updateLiveness(live);
+    return live;
+}
+
+// Finds the blocks of the loop formed by the latch branching back to the header, returns the block entering it or -1 if
+// the loop can be entered anywhere else
+int findLoop(const IRFunction& function, int header, int latch, std::vector<bool>& inLoop) {
+    const auto& blocks = function.blocks;
+    inLoop.assign(blocks.size(), false);
+    inLoop[header] = true;
+    std::vector<int> worklist{latch};
+    while (!worklist.empty()) {
+        const int i = worklist.back();
+        worklist.pop_back();
+        if (inLoop[i])
+            continue;
+        inLoop[i] = true;
+        worklist.insert(worklist.end(), blocks[i].predecessors.begin(), blocks[i].predecessors.end());
+    }
+
+    int preheader = -1;
+    for (int i = 0; i < blocks.size(); i++) {
+        if (!inLoop[i])
+            continue;
+        if (i == 0 || blocks[i].hasUnknownPredecessors || blocks[i].exitsToUnknownLabel)
+            return -1;
+        for (int predecessor : blocks[i].predecessors) {
+            if (inLoop[predecessor])
+                continue;
+            if (i != header || preheader >= 0)
+                return -1;
+            preheader = predecessor;
+        }
+    }
+    return preheader;
+}
+
+// Follows the code from an instruction through labels and jumps, true if the first thing it does is return "_"
+bool returnsResult(const IRFunction& function, int block, int index) {
+    const auto& blocks = function.blocks;
+    for (int visited = 0; visited <= blocks.size();) {
+        if (index == blocks[block].code.size() || blocks[block].code[index].opcode == IR_JUMP) {
+            if (blocks[block].successors.size() != 1)
+                return false;
+            block = blocks[block].successors[0];
+            index = 0;
+            visited++;
+            continue;
+        }
+        const auto& instr = blocks[block].code[index];
+        if (instr.opcode == IR_LABEL) {
+            index++;
+            continue;
+        }
+        // Falling off the end of the function returns "_" too
+        if (instr.opcode != IR_RETURN)
+            return false;
+        return instr.operands.empty() ? instr.external : instr.operands[0] == IRValue::variable(IR_RETURN_VARIABLE);
+    }
+    return false;
+}
+
+int countInstructions(const IRFunction& function) {
+    int count = 0;
+    for (const auto& block : function.blocks)
+        count += static_cast<int>(block.code.size());
+    return count;
+}
+
+} // namespace
+
+IROptimizer::IROptimizer(IRFunction& function_)
+        : function(function_) {}
+
+int IROptimizer::run() {
+    this->function.buildBlocks();
+    const auto originalSize = countInstructions(this->function);
+    for (int round = 0; round < IR_OPTIMIZER_MAX_ROUNDS; round++) {
+        bool changed = this->propagateConstants();
+        this->function.buildBlocks();
+        changed |= this->removeUnreachableBlocks();
+        this->function.buildBlocks();
+        changed |= this->propagateCopies();
+        changed |= this->eliminateDeadStores();
+        changed |= this->hoistLoopInvariants();
+        changed |= this->mergePrints();
+        changed |= this->eliminateTailCalls();
+        if (!changed)
+            break;
+    }
+    return originalSize - countInstructions(this->function);
+}
+
+bool IROptimizer::propagateConstants() {
+    const std::vector<LatticeValue> unknown(this->function.variableCount, {LATTICE_VARYING});
+    const auto in = solveForward(this->function, unknown, meetConstants, transferConstants);
+
+    bool changed = false;
+    for (int i = 0; i < this->function.blocks.size(); i++) {
+        if (!in[i])
+            continue;
+        auto state = *in[i];
+        auto& code = this->function.blocks[i].code;
+        for (auto instr = code.begin(); instr != code.end();) {
+            // Raw asm needs its operands to stay in registers
+            if (instr->opcode != IR_ASM) {
+                for (auto& operand : instr->operands) {
+                    if (operand.isVariable() && state[operand.value].kind == LATTICE_CONSTANT) {
+                        operand = IRValue::constant(state[operand.value].value);
+                        changed = true;
+                    }
+                }
+            }
+            if (instr->isArithmetic() && instr->opcode != IR_MOVE && instr->operands[0].isConstant() && instr->operands[1].isConstant()) {
+                if (int64_t value; evaluateArithmetic(instr->opcode, instr->operands[0].value, instr->operands[1].value, value)) {
+                    instr->opcode = IR_MOVE;
+                    instr->operands = {IRValue::constant(value)};
+                    changed = true;
+                }
+            }
+            if (instr->opcode == IR_BRANCH && instr->operands[0].isConstant() && instr->operands[1].isConstant()) {
+                changed = true;
+                if (!evaluateCondition(instr->condition, instr->operands[0].value, instr->operands[1].value)) {
+                    instr = code.erase(instr);
+                    continue;
+                }
+                instr->opcode = IR_JUMP;
+                instr->operands.clear();
+            }
+            transferConstants(*instr, state);
+            ++instr;
+        }
+    }
+    return changed;
+}
+
+bool IROptimizer::propagateCopies() {
+    const auto variableCount = this->function.variableCount;
+    CopyState unknown{std::vector<int64_t>(variableCount), std::vector<std::pair<int, int64_t>>(variableCount, {-1, 0})};
+    for (int i = 0; i < variableCount; i++)
+        unknown.definitions[i] = getMergedDefinition(0, i, variableCount);
+    const auto in = solveForward(this->function, unknown, meetCopies, transferCopies);
+
+    bool changed = false;
+    for (int i = 0; i < this->function.blocks.size(); i++) {
+        if (!in[i])
+            continue;
+        auto state = *in[i];
+        for (auto& instr : this->function.blocks[i].code) {
+            if (instr.opcode != IR_ASM) {
+                for (auto& operand : instr.operands) {
+                    if (!operand.isVariable())
+                        continue;
+                    if (const auto source = state.getSource(static_cast<int>(operand.value)); source >= 0) {
+                        operand = IRValue::variable(source);
+                        changed = true;
+                    }
+                }
+            }
+            transferCopies(instr, state);
+        }
+    }
+    return changed;
+}
+
+bool IROptimizer::eliminateDeadStores() {
+    auto& blocks = this->function.blocks;
+    const auto liveOut = this->function.getLiveOut();
+
+    bool changed = false;
+    for (int i = 0; i < blocks.size(); i++) {
+        auto& code = blocks[i].code;
+        auto live = liveOut[i];
+        std::vector<bool> dead(code.size());
+        for (int j = static_cast<int>(code.size()) - 1; j >= 0; j--) {
+            const auto& instr = code[j];
+            // A division that can fail still has to stop the program even if nothing reads its result
+            if (instr.isArithmetic() && !instr.canFail() && (!live[instr.dst.value] || (instr.opcode == IR_MOVE && instr.operands[0] == instr.dst))) {
+                dead[j] = true;
+                changed = true;
+                continue;
+            }
+            instr.updateLiveness(live);
+        }
+        int kept = 0;
+        for (int j = 0; j < code.size(); j++) {
+            if (!dead[j] && kept++ != j)
+                code[kept - 1] = std::move(code[j]);
+        }
+        code.resize(kept);
+    }
+    return changed;
+}
+
+bool IROptimizer::removeUnreachableBlocks() {
+    auto& blocks = this->function.blocks;
+    std::vector<bool> reachable(blocks.size());
+    std::vector<int> worklist;
+    for (int i = 0; i < blocks.size(); i++) {
+        if (i == 0 || blocks[i].hasUnknownPredecessors)
+            worklist.push_back(i);
+    }
+    while (!worklist.empty()) {
+        const int i = worklist.back();
+        worklist.pop_back();
+        if (reachable[i])
+            continue;
+        reachable[i] = true;
+        worklist.insert(worklist.end(), blocks[i].successors.begin(), blocks[i].successors.end());
+    }
+
+    int kept = 0;
+    for (int i = 0; i < blocks.size(); i++) {
+        if (reachable[i] && kept++ != i)
+            blocks[kept - 1] = std::move(blocks[i]);
+    }
+    const bool changed = kept != blocks.size();
+    blocks.resize(kept);
+    return changed;
+}
+
+bool IROptimizer::hoistLoopInvariants() {
+    // Worked out once, hoisting keeps it up to date for the loops after it
+    auto liveOut = this->function.getLiveOut();
+    bool changed = false;
+    for (int latch = 0; latch < this->function.blocks.size(); latch++) {
+        // Branching back to an earlier block closes a loop, the successors are copied since hoisting can't change them
+        for (int header : std::vector{this->function.blocks[latch].successors}) {
+            if (header <= latch)
+                changed |= this->hoistLoopInvariants(header, latch, liveOut);
+        }
+    }
+    return changed;
+}
+
+bool IROptimizer::hoistLoopInvariants(int header, int latch, std::vector<std::vector<bool>>& liveOut) {
+    auto& blocks = this->function.blocks;
+    std::vector<bool> inLoop;
+    const int preheader = findLoop(this->function, header, latch, inLoop);
+    if (preheader < 0)
+        return false;
+
+    // A hoisted instruction runs even if the loop doesn't, so it can't overwrite anything read after leaving the preheader
+    // or the loop, or anything carried between iterations
+    auto keep = getLiveIn(blocks[header], liveOut[header]);
+    for (int i = 0; i < blocks.size(); i++) {
+        if (!inLoop[i] && i != preheader)
+            continue;
+        for (int successor : blocks[i].successors) {
+            if (inLoop[successor])
+                continue;
+            const auto live = getLiveIn(blocks[successor], liveOut[successor]);
+            for (int id = 0; id < live.size(); id++) {
+                if (live[id])
+                    keep[id] = true;
+            }
+        }
+    }
+    auto& destination = blocks[preheader].code;
+    const bool endsWithBranch = !destination.empty() && destination.back().isTerminator();
+    if (endsWithBranch)
+        destination.back().forEachUse([&keep](int id) {
+            keep[id] = true;
+        });
+
+    std::vector<int> definitions(this->function.variableCount);
+    for (int i = 0; i < blocks.size(); i++) {
+        if (!inLoop[i])
+            continue;
+        for (const auto& instr : blocks[i].code)
+            instr.forEachDef([&definitions](int id) {
+                definitions[id]++;
+            });
+    }
+    const auto isInvariant = [&definitions](const IRValue& value) {
+        return value.isConstant() || (value.isVariable() && definitions[value.value] == 0);
+    };
+
+    bool changed = false;
+    for (bool hoisted = true; hoisted;) {
+        hoisted = false;
+        for (int i = 0; i < blocks.size(); i++) {
+            if (!inLoop[i])
+                continue;
+            auto& code = blocks[i].code;
+            for (auto instr = code.begin(); instr != code.end();) {
+                const auto dst = instr->dst.value;
+                // Division that can fail only happens if the loop reaches it
+                if (!instr->isArithmetic() || instr->canFail() || definitions[dst] != 1 || keep[dst]
+                    || !std::all_of(instr->operands.begin(), instr->operands.end(), isInvariant)) {
+                    ++instr;
+                    continue;
+                }
+                definitions[dst] = 0;
+                // The value is now carried from the preheader through the loop. Its operands were already live there and it
+                // isn't read outside the loop, so marking it live in the loop is enough to keep liveness safe for later loops
+                liveOut[preheader][dst] = true;
+                for (int j = 0; j < blocks.size(); j++) {
+                    if (inLoop[j])
+                        liveOut[j][dst] = true;
+                }
+                destination.insert(endsWithBranch ? destination.end() - 1 : destination.end(), std::move(*instr));
+                instr = code.erase(instr);
+                hoisted = changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+bool IROptimizer::mergePrints() {
+    std::unordered_map<std::string, std::string> contents;
+    for (const auto& str : this->function.strings)
+        contents.emplace(getStringLabel(str), str);
+
+    bool changed = false;
+    for (auto& block : this->function.blocks) {
+        auto& code = block.code;
+        std::vector<bool> merged(code.size());
+        // The prints of the run being gathered, they are only joined once it ends
+        std::vector<int> run;
+        std::size_t runLength = 0;
+        const auto finishRun = [&] {
+            if (run.size() > 1) {
+                std::string str;
+                str.reserve(runLength);
+                for (int j : run) {
+                    str += contents.at(code[j].label);
+                    merged[j] = true;
+                }
+                // The last print is where the output would have been complete
+                merged[run.back()] = false;
+                code[run.back()].label = this->function.addString(str);
+                contents.emplace(code[run.back()].label, std::move(str));
+                changed = true;
+            }
+            run.clear();
+            runLength = 0;
+        };
+        for (int j = 0; j < code.size(); j++) {
+            const auto& instr = code[j];
+            if (instr.opcode == IR_PRINT) {
+                const auto length = contents.at(instr.label).size();
+                if (runLength + length > IR_OPTIMIZER_MAX_PRINT_LENGTH)
+                    finishRun();
+                run.push_back(j);
+                runLength += length;
+            } else if (!instr.isArithmetic() || instr.canFail()) {
+                // Arithmetic can happen between two prints without anyone noticing they were written at once
+                finishRun();
+            }
+        }
+        finishRun();
+        int kept = 0;
+        for (int j = 0; j < code.size(); j++) {
+            if (!merged[j] && kept++ != j)
+                code[kept - 1] = std::move(code[j]);
+        }
+        code.resize(kept);
+    }
+    if (!changed)
+        return false;
+
+    // Drop the strings that were only printed by the prints merged away
+    std::unordered_set<std::string> printed;
+    for (const auto& block : this->function.blocks) {
+        for (const auto& instr : block.code) {
+            if (instr.opcode == IR_PRINT)
+                printed.insert(instr.label);
+        }
+    }
+    this->function.removeStrings([&printed](const std::string& label) {
+        return !printed.contains(label);
+    });
+    return true;
+}
+
+bool IROptimizer::eliminateTailCalls() {
+    if (!this->function.isProcedure)
+        return false;
+    auto& blocks = this->function.blocks;
+    std::string entry;
+    bool changed = false;
+    for (int i = 0; i < blocks.size(); i++) {
+        auto& code = blocks[i].code;
+        for (int j = 0; j < code.size(); j++) {
+            if (code[j].opcode != IR_CALL || !returnsResult(this->function, i, j + 1))
+                continue;
+            auto call = std::move(code[j]);
+            code.resize(j);
+            changed = true;
+            if (call.label != this->function.name) {
+                call.opcode = IR_TAIL_CALL;
+                code.push_back(std::move(call));
+                break;
+            }
+            // The arguments may read the parameters, so they are all copied before any parameter is overwritten
+            if (entry.empty())
+                entry = "." + this->function.getLocalName(IR_ENTRY_LABEL_PREFIX, this->function.labelCount++);
+            std::vector<IRValue> arguments;
+            for (const auto& operand : call.operands) {
+                arguments.push_back(IRValue::variable(this->function.addVariable()));
+                code.push_back({.opcode = IR_MOVE, .dst = arguments.back(), .operands = {operand}, .line = call.line});
+            }
+            for (int parameter = 0; parameter < arguments.size(); parameter++)
+                code.push_back({.opcode = IR_MOVE, .dst = IRValue::variable(parameter + 1), .operands = {arguments[parameter]}, .line = call.line});
+            code.push_back({.opcode = IR_JUMP, .label = entry, .line = call.line});
+            break;
+        }
+    }
+    if (!entry.empty())
+        blocks[0].code.insert(blocks[0].code.begin(), {.opcode = IR_LABEL, .label = entry, .line = this->function.position.line});
+    if (changed)
+        this->function.buildBlocks();
+    return changed;
+}
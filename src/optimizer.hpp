@@ -0,0 +1,27 @@
+#pragma once
+
+#include "ir.hpp"
+
+class IROptimizer {
+public:
+    explicit IROptimizer(IRFunction& function);
+    // Runs every pass until none of them changes anything, returns how many instructions were removed
+    int run();
+private:
+    IRFunction& function;
+
+    // Replaces variables holding a known constant and folds the arithmetic and branches using them
+    bool propagateConstants();
+    // Replaces variables holding a copy of another variable with the original
+    bool propagateCopies();
+    // Removes assignments to variables that are never read afterwards
+    bool eliminateDeadStores();
+    bool removeUnreachableBlocks();
+    // Moves arithmetic that gives the same result on every iteration of a loop to just before it
+    bool hoistLoopInvariants();
+    bool hoistLoopInvariants(int header, int latch, std::vector<std::vector<bool>>& liveOut);
+    // Joins prints with nothing that could be seen in between into one string and one write
+    bool mergePrints();
+    // Turns calls whose result is returned straight away into jumps, calls to the function itself become a loop
+    bool eliminateTailCalls();
+};
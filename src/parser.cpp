@@ -2,136 +2,186 @@
 
 #include <algorithm>
 #include <cctype>
+#include <charconv>
+#include <chrono>
 #include <stack>
+#include <utility>
 
+#include "lowering.hpp"
+#include "optimizer.hpp"
+#include "peephole.hpp"
+#include "regalloc.hpp"
 #include "utilities.hpp"
+#include "x86.hpp"
 
 #define ASM_IF_LABEL_PREFIX "_if"
 #define ASM_WHILE_LABEL_PREFIX "_while"
-#define ASM_STRING_PREFIX "_str"
 #define ASM_PROCEDURE_END_LABEL "_proc_end"
-#define ASM_REGISTER_MATH_HELPER "x9"
-#define ASM_REGISTER_RETURN_VALUE "x10"
-// There is a predefined return variable "_"
-#define ASM_REGISTER_OFFSET 10
-#define ASM_REGISTER_TRUE_OFFSET 11
 
-Parser::Parser(const std::string& filepath) {
-    this->file.open(filepath, std::ios::in);
+namespace {
+
+double getMilliseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
-Parser::~Parser() {
-    this->file.close();
+// Counts the instructions and labels in a section of assembly, instructions are the only indented lines
+void countLines(std::string_view assembly, std::size_t& instructions, std::size_t& labels) {
+    std::vector<std::string_view> lines;
+    splitString(assembly, lines, '\n');
+    for (const auto line : lines) {
+        if (line.starts_with('\t'))
+            instructions++;
+        else if (line.ends_with(':'))
+            labels++;
+    }
 }
 
+} // namespace
+
+Parser::Parser(const std::string& filepath, ParserOptions options_)
+        : source(filepath)
+        , options(options_) {}
+
+Parser::Parser(const std::string& filepath, std::string contents, ParserOptions options_)
+        : source(filepath, std::move(contents))
+        , options(options_) {}
+
 std::string Parser::parse() {
-    std::vector<std::string> unparsedLines;
-    if (!getFileContents(unparsedLines))
+    auto error = this->parseSource();
+    // Point at the line that caused the error, if there is one
+    if (!error.empty() && this->position.line > 0)
+        return this->position.toString() + ": " + error;
+    return error;
+}
+
+std::string Parser::parseSource() {
+    std::vector<SourceLine> unparsedLines;
+    std::vector<std::string_view> tokens;
+    const auto readStart = std::chrono::steady_clock::now();
+    if (!getFileContents(unparsedLines, tokens))
         return "Error reading file!";
+    this->stats.readMilliseconds = getMilliseconds(readStart);
+    this->stats.sourceLines = unparsedLines.size();
+    const auto parseStart = std::chrono::steady_clock::now();
 
     pushVariableStack();
+    this->mainFunction.position.file = this->source.getPath();
 
-    this->main << ".text" << ".global _start" << "_start:";
-    this->main.indent();
-    this->procedures.indent();
-    this->procedures << "b ." ASM_PROCEDURE_END_LABEL;
-
-    uint16_t hardcodedLabels = 0;
-    std::stack<std::string> endings;
+    std::stack<std::vector<IRInstruction>> endings;
 
     int callDepth = 0;
 
-    for (const auto& line : unparsedLines) {
-        auto lines = splitString(line);
+    for (const auto& sourceLine : unparsedLines) {
+        const auto line = sourceLine.text;
+        const std::span<const std::string_view> lines{tokens.data() + sourceLine.firstToken, sourceLine.tokenCount};
         if (lines.empty())
             continue;
+        this->position = sourceLine.position;
 
         if (this->insideASM && lines[0] != "end") {
-            // replace ${var} with the proper register
-            std::string asmLine = line;
-            for (int i = 0; i < this->variables.top().size(); i++) {
-                std::string varToReplace = "${" + this->variables.top().at(i) + "}";
-                replaceSubstring(asmLine, varToReplace, "x" + std::to_string(i + ASM_REGISTER_OFFSET));
+            // replace ${var} with a placeholder for the register the variable is allocated to
+            IRInstruction instr{.opcode = IR_ASM};
+            std::size_t pos = 0;
+            for (auto found = line.find("${"); found != std::string::npos; found = line.find("${", pos)) {
+                const auto close = line.find('}', found);
+                if (close == std::string::npos)
+                    break;
+                IRValue operand;
+                if (parseValue(line.substr(found + 2, close - found - 2), operand) != VALUE_VARIABLE) {
+                    instr.text += line.substr(pos, close + 1 - pos);
+                    pos = close + 1;
+                    continue;
+                }
+                auto index = std::find(instr.operands.begin(), instr.operands.end(), operand) - instr.operands.begin();
+                if (index == instr.operands.size())
+                    instr.operands.push_back(operand);
+                instr.text += line.substr(pos, found - pos);
+                instr.text += "${" + std::to_string(index) + '}';
+                pos = close + 1;
             }
-            this->activeCode() << asmLine;
+            instr.text += line.substr(pos);
+            this->emit(std::move(instr));
             continue;
         }
 
         if (lines[0] == "if") {
-            std::string value1 = lines[1], op = lines[2], value2 = lines[3];
-            if (lines.size() != 4 || !parseValue(value1) || !parseLogicalOperator(op) || !parseValue(value2))
-                return "Invalid syntax for if call: \"" + line + '\"';
-
-            std::string branch = op;
-            std::string label = "." ASM_IF_LABEL_PREFIX + std::to_string(hardcodedLabels++);
-            branch += ' ' + label;
-            this->activeCode() << "cmp " + value1 + ", " + value2 << branch;
-            endings.push(label + ':');
+            std::string label = "." + this->getLocalName(ASM_IF_LABEL_PREFIX);
+            if (!this->emitConditionalBranch(lines, 1, label))
+                return "Invalid syntax for if call: \"" + std::string{line} + '\"';
+            endings.push({{.opcode = IR_LABEL, .label = label}});
 
             callDepth++;
 
         } else if (lines[0] == "while") {
-            std::string value1 = lines[1], op = lines[2], value2 = lines[3];
-            if (lines.size() != 4 || !parseValue(value1) || !parseLogicalOperator(op) || !parseValue(value2))
-                return "Invalid syntax for while call: \"" + line + '\"';
-
-            this->activeCode().dedent();
-            this->activeCode() << "." ASM_WHILE_LABEL_PREFIX + std::to_string(hardcodedLabels++) + ':';
-            this->activeCode().indent();
-            std::string branch = op;
-            std::string labelEnd = "." ASM_WHILE_LABEL_PREFIX + std::to_string(hardcodedLabels++);
-            branch += ' ' + labelEnd;
-            this->activeCode() << "cmp " + value1 + ", " + value2 << branch;
-            endings.push("b ." ASM_WHILE_LABEL_PREFIX + std::to_string(hardcodedLabels - 2) + '\n' + labelEnd + ':');
+            std::string labelStart = "." + this->getLocalName(ASM_WHILE_LABEL_PREFIX);
+            std::string labelEnd = "." + this->getLocalName(ASM_WHILE_LABEL_PREFIX);
+            if (this->options.optimizationLevel >= 1) {
+                // Skip the loop if the condition fails the first time, afterwards it is tested at the bottom and branches back while it holds
+                const auto conditionBegin = this->activeFunction().code.size();
+                if (!this->emitConditionalBranch(lines, 1, labelEnd))
+                    return "Invalid syntax for while call: \"" + std::string{line} + '\"';
+                const auto& code = this->activeFunction().code;
+                std::vector<IRInstruction> ending{code.begin() + static_cast<std::ptrdiff_t>(conditionBegin), code.end()};
+                ending.back().condition = invertCondition(ending.back().condition);
+                ending.back().label = labelStart;
+                ending.push_back({.opcode = IR_LABEL, .label = labelEnd});
+                this->emit({.opcode = IR_LABEL, .label = labelStart});
+                endings.push(std::move(ending));
+            } else {
+                // The condition is evaluated again on every iteration
+                this->emit({.opcode = IR_LABEL, .label = labelStart});
+                if (!this->emitConditionalBranch(lines, 1, labelEnd))
+                    return "Invalid syntax for while call: \"" + std::string{line} + '\"';
+                endings.push({{.opcode = IR_JUMP, .label = labelStart}, {.opcode = IR_LABEL, .label = labelEnd}});
+            }
 
             callDepth++;
 
         } else if (lines[0] == "func") {
-            if (lines.size() < 2 || lines.size() >= 10)
-                return "Invalid syntax for func call: \"" + line + '\"';
-            if (!isValidIdentifier(lines[1]))
-                return "Function identifier is invalid: \"" + line + '\"';
+            // func inline name ... is the same as func name ..., but asks for every call to be inlined
+            const bool isInline = lines.size() > 2 && lines[1] == "inline";
+            const auto declaration = lines.subspan(isInline ? 1 : 0);
+            if (declaration.size() < 2 || declaration.size() >= 10)
+                return "Invalid syntax for func call: \"" + std::string{line} + '\"';
+            if (!isValidIdentifier(declaration[1]))
+                return "Function identifier is invalid: \"" + std::string{line} + '\"';
             if (this->insideProcedure)
-                return "Cannot have functions inside functions! (\"" + line + "\")";
+                return "Cannot have functions inside functions! (\"" + std::string{line} + "\")";
             this->insideProcedure = true;
+            this->procedureFunction = IRFunction{std::string{declaration[1]}, true};
+            this->procedureFunction.isInline = isInline;
+            this->procedureFunction.position = this->position;
 
-            this->activeCode().dedent();
-            this->activeCode() << lines[1] + ':';
-            this->activeCode().indent();
-            this->activeCode() << "str lr, [sp, #-0x10]!";
-            endings.push("ldr lr, [sp], #0x10\n\tret");
+            // Falling off the end returns whatever is in "_"
+            endings.push({{.opcode = IR_RETURN, .external = true}});
             pushVariableStack();
 
-            // Add expected arguments, and copy them to the appropriate registers
-            std::vector<std::string> parameters;
-            for (int i = 2; i < lines.size(); i++) {
-                parameters.push_back(lines[i]);
-                this->variables.top().push_back(lines[i]);
-                // i-2: x0 when i is 0, etc.
-                this->activeCode() << "mov x" + std::to_string(i - 2 + ASM_REGISTER_TRUE_OFFSET) + ", x" + std::to_string(i-2);
-            }
-            this->functions[lines[1]] = parameters;
+            // Add expected arguments, they are copied out of x0-x7 when the function is lowered
+            for (int i = 2; i < declaration.size(); i++)
+                this->declareVariable(declaration[i]);
+            this->procedureFunction.parameterCount = static_cast<int>(declaration.size()) - 2;
+            this->symbolTable.declareFunction(this->symbolTable.intern(declaration[1]), this->procedureFunction.parameterCount);
 
             callDepth++;
 
         } else if (lines[0] == "return") {
-            if (lines.size() > 2)
-                return "Invalid syntax for return call: \"" + line + '\"';
-
-            if (lines.size() == 2) {
-                std::string value = lines[1];
-                if (!parseValue(value))
-                    return "Invalid syntax for return call: \"" + line + '\"';
+            if (!this->insideProcedure)
+                return "Cannot return from outside a function: \"" + std::string{line} + '\"';
 
-                this->activeCode() << "mov " ASM_REGISTER_RETURN_VALUE ", " + value;
-            } else {
-                this->activeCode() << "mov " ASM_REGISTER_RETURN_VALUE ", #0";
+            IRInstruction instr{.opcode = IR_RETURN};
+            if (lines.size() > 1) {
+                auto expression = this->parseExpression(lines, 1, lines.size());
+                if (!expression)
+                    return "Invalid syntax for return call: \"" + std::string{line} + '\"';
+                instr.operands.push_back(this->emitExpression(*expression, 0));
             }
-            this->activeCode() << "ldr lr, [sp], #0x10" << "ret";
+            this->emit(std::move(instr));
 
         } else if (lines[0] == "asm") {
             if (lines.size() > 1)
-                return "Invalid syntax for asm call: \"" + line + '\"';
+                return "Invalid syntax for asm call: \"" + std::string{line} + '\"';
+            if (this->options.target != TARGET_AARCH64)
+                return "asm blocks can only be compiled for AArch64: \"" + std::string{line} + '\"';
             this->insideASM = true;
             // no need to bump callDepth here
 
@@ -139,13 +189,13 @@ std::string Parser::parse() {
             if (this->insideASM) {
                 this->insideASM = false;
             } else {
-                if (endings.top().starts_with('.'))
-                    this->activeCode().dedent();
-                this->activeCode() << endings.top();
-                if (endings.top().starts_with('.'))
-                    this->activeCode().indent();
+                if (endings.empty())
+                    return "Unexpected end: \"" + std::string{line} + '\"';
+                for (auto instr : endings.top())
+                    this->emit(std::move(instr));
                 // Only end function if we are actually ending the function
                 if (this->insideProcedure && callDepth == 1) {
+                    this->finishProcedure();
                     this->insideProcedure = false;
                     popVariableStack();
                 }
@@ -155,137 +205,86 @@ std::string Parser::parse() {
             }
 
         } else if (lines[0] == "let") {
-            if (lines.size() < 4 || lines.size() > 4 || lines[2] != "=" || hasVariable(lines[1]))
-                return "Invalid syntax for let call: \"" + line + '\"';
+            if (lines.size() < 4 || lines[2] != "=" || this->getValueType(lines[1]) == VALUE_VARIABLE)
+                return "Invalid syntax for let call: \"" + std::string{line} + '\"';
             if (!isValidIdentifier(lines[1]))
-                return "Variable identifier is invalid: \"" + line + '\"';
-            std::string value = lines[3];
-            if (!parseValue(value))
-                return "Invalid syntax: \"" + line + '\"';
+                return "Variable identifier is invalid: \"" + std::string{line} + '\"';
+            // The new variable can't be used in its own initializer
+            auto expression = this->parseExpression(lines, 3, lines.size());
+            if (!expression)
+                return "Invalid syntax: \"" + std::string{line} + '\"';
 
-            this->activeCode() << "mov x" + std::to_string(this->variables.top().size() + ASM_REGISTER_OFFSET) + ", " + value;
-            this->variables.top().push_back(lines[1]);
+            this->emitExpression(*expression, 0, this->declareVariable(lines[1]));
 
         } else if (lines[0] == "label") {
             if (lines.size() < 2)
-                return "Invalid syntax for label: \"" + line + '\"';
+                return "Invalid syntax for label: \"" + std::string{line} + '\"';
 
-            this->activeCode().dedent();
-            this->activeCode() << "." + lines[1] + ":";
-            this->activeCode().indent();
+            // Other functions can jump here too
+            this->emit({.opcode = IR_LABEL, .label = "." + std::string{lines[1]}, .external = true});
 
         } else if (lines[0] == "goto") {
             if (lines.size() < 2)
-                return "Invalid syntax for goto: \"" + line + '\"';
-
-            this->activeCode() << "b ." + lines[1];
-
-        } else if (lines[0] == "print") {
-            if (lines.size() < 2)
-                return "Invalid syntax for print: \"" + line + '\"';
+                return "Invalid syntax for goto: \"" + std::string{line} + '\"';
 
-            this->activeCode() << "mov x0, #1";
-            auto str = std::string{ASM_STRING_PREFIX} + std::to_string(this->strings.size());
-            this->activeCode() << "ldr x1, =" + str << "ldr x2, =" + str + "_len";
-            this->activeCode() << "mov x8, 0x40" << "svc 0";
-            std::string literal = line.substr(6);
-            if (!parseStringLiteral(literal))
-                return "Encountered invalid literal: " + literal;
-            this->strings.push_back(literal);
+            this->emit({.opcode = IR_JUMP, .label = "." + std::string{lines[1]}});
 
-        } else if (lines[0] == "println") {
+        } else if (lines[0] == "print" || lines[0] == "println") {
             if (lines.size() < 2)
-                return "Invalid syntax for println: \"" + line + '\"';
+                return "Invalid syntax for " + std::string{lines[0]} + ": \"" + std::string{line} + '\"';
 
-            this->activeCode() << "mov x0, #1";
-            auto str = std::string{ASM_STRING_PREFIX} + std::to_string(this->strings.size());
-            this->activeCode() << "ldr x1, =" + str << "ldr x2, =" + str + "_len";
-            this->activeCode() << "mov x8, 0x40" << "svc 0";
-            std::string literal = line.substr(8);
+            std::string literal{line.substr(lines[0].length() + 1)};
             if (!parseStringLiteral(literal))
                 return "Encountered invalid literal: " + literal;
-            this->strings.push_back(literal + "\\n");
+            this->emit({.opcode = IR_PRINT, .label = this->activeFunction().addString(lines[0] == "println" ? literal + "\\n" : literal)});
 
         } else if (lines[0] == "exit") {
-            if (lines.size() > 2)
-                return "Invalid syntax for exit: \"" + line + '\"';
-
+            IRInstruction instr{.opcode = IR_EXIT};
             if (lines.size() > 1) {
-                std::string value = lines[1];
-                if (!parseValue(value))
-                    return "Invalid syntax: \"" + line + '\"';
-                this->activeCode() << "mov x0, " + value;
+                auto expression = this->parseExpression(lines, 1, lines.size());
+                if (!expression)
+                    return "Invalid syntax: \"" + std::string{line} + '\"';
+                instr.operands.push_back(this->emitExpression(*expression, 0));
             }
-            this->activeCode() << "mov x8, #93" << "svc 0";
+            this->emit(std::move(instr));
 
         } else if (const auto type = getValueType(lines[0]); type != VALUE_ERROR) {
             switch (type) {
                 case VALUE_VARIABLE: {
-                    if (lines.size() == 3) {
-                        std::string op;
-                        if (lines[1] == "=") {
-                            op = "mov";
-                        } else {
-                            op = lines[1].substr(0, 1);
-                            if (!parseMathOperator(op))
-                                return "Invalid syntax: \"" + line + '\"';
-                        }
-
-                        std::string var = lines[0], value = lines[2];
-                        if (!parseValue(var) || !parseValue(value))
-                            return "Invalid syntax: \"" + line + '\"';
-
-                        this->activeCode() << op + ' ' + var + ", " + (lines[1] != "=" ? var + ", " : "") + value;
-                    } else if (lines.size() == 5 && lines[1] == "=") {
-                        std::string op = lines[3];
-                        if (!parseMathOperator(op))
-                            return "Invalid syntax: \"" + line + '\"';
-
-                        std::string var = lines[0], value1 = lines[2], value2 = lines[4];
-                        if (!parseValue(var) || !parseValue(value1) || !parseValue(value2))
-                            return "Invalid syntax: \"" + line + '\"';
-                        // todo: this can be extended to larger equations
-                        this->activeCode() << op + " " ASM_REGISTER_MATH_HELPER ", " + value1 + ", " + value2;
-                        this->activeCode() << "mov " + var + ", " ASM_REGISTER_MATH_HELPER;
-                    } else {
-                        return "Invalid syntax: \"" + line + '\"';
+                    IRValue var;
+                    if (lines.size() < 3 || !parseValue(lines[0], var))
+                        return "Invalid syntax: \"" + std::string{line} + '\"';
+                    auto expression = this->parseExpression(lines, 2, lines.size());
+                    if (!expression)
+                        return "Invalid syntax: \"" + std::string{line} + '\"';
+
+                    if (lines[1] != "=") {
+                        // x += y is x = x + (y)
+                        IROpcode op;
+                        if (lines[1].length() != 2 || !lines[1].ends_with('=') || !parseMathOperator(lines[1].substr(0, 1), op))
+                            return "Invalid syntax: \"" + std::string{line} + '\"';
+                        expression = Expression::binary(op, Expression::leaf(var), std::move(expression));
                     }
+                    this->emitExpression(*expression, 0, var);
                     break;
                 }
 
                 case VALUE_FUNCTION: {
-                    if (!this->functions.contains(lines[0]))
-                        return "Function is not defined: \"" + line + '\"';
-                    if (this->functions.at(lines[0]).size() != lines.size() - 1)
-                        return "Function has a different number of parameters: \"" + line + '\"';
-
-                    const auto& vars = this->variables.top();
+                    const auto* function = this->symbolTable.findFunction(this->symbolTable.intern(lines[0]));
+                    if (!function)
+                        return "Function is not defined: \"" + std::string{line} + '\"';
+                    if (function->parameterCount != lines.size() - 1)
+                        return "Function has a different number of parameters: \"" + std::string{line} + '\"';
 
-                    // Copy all arguments to x0-x7 (which are copied to usable registers inside the func)
+                    IRInstruction instr{.opcode = IR_CALL, .label = std::string{lines[0]}};
                     for (int i = 1; i < lines.size(); i++) {
-                        std::string value = lines[i];
-                        const auto valType = parseValue(value);
-                        if (valType == VALUE_NUMBER) {
-                            this->activeCode() << "mov x" + std::to_string(i-1) + ", " + value;
-                        } else if (valType == VALUE_VARIABLE) {
-                            for (const auto& var : vars) {
-                                if (var == lines[i]) {
-                                    this->activeCode() << "mov x" + std::to_string(i-1) + ", " + value;
-                                }
-                            }
-                        } else {
-                            return "Invalid syntax for function call: \"" + line + '\"';
-                        }
-                    }
-
-                    for (int i = ASM_REGISTER_TRUE_OFFSET; i < vars.size() + ASM_REGISTER_OFFSET; i++) {
-                        // this is a waste of space... too bad!
-                        this->activeCode() << "str x" + std::to_string(i) + ", [sp, #-0x10]!";
-                    }
-                    this->activeCode() << "bl " + lines[0];
-                    for (int i = static_cast<int>(vars.size()) + ASM_REGISTER_OFFSET - 1; i >= ASM_REGISTER_TRUE_OFFSET; i--) {
-                        this->activeCode() << "ldr x" + std::to_string(i) + ", [sp], #0x10";
+                        IRValue value;
+                        const auto valType = parseValue(lines[i], value);
+                        if (valType != VALUE_NUMBER && valType != VALUE_VARIABLE)
+                            return "Invalid syntax for function call: \"" + std::string{line} + '\"';
+                        instr.operands.push_back(value);
                     }
+                    this->emit(std::move(instr));
                     break;
                 }
 
@@ -294,46 +293,351 @@ std::string Parser::parse() {
             }
 
         } else {
-            return "Encountered unexpected operation! Found in line that reads \"" + line + "\"";
+            return "Encountered unexpected operation! Found in line that reads \"" + std::string{line} + "\"";
         }
     }
 
-    this->main.setIndent(0);
-    this->procedures.setIndent(0);
-    this->procedures << "." ASM_PROCEDURE_END_LABEL ":";
+    // Anything past here isn't caused by a specific line
+    this->position = {};
+
+    if (!endings.empty())
+        return "Missing end for an if, while or func block";
+
+    this->inlineCalls(this->mainFunction);
+    this->finishFunction(this->mainFunction);
+    this->stats.parseMilliseconds = getMilliseconds(parseStart) - this->stats.optimizeMilliseconds;
+    const auto emitStart = std::chrono::steady_clock::now();
+    // Functions nothing calls are left out
+    const auto reachable = this->getReachableFunctions();
+
+    // Every section is written into the same buffer in order
+    this->output << ".text" << ".global _start" << "_start:";
+    this->output.indent();
+    if (auto error = this->emitFunction(this->mainFunction, this->output); !error.empty())
+        return error;
+    this->procedureOffset = this->output.getSize();
+    this->output << (this->options.target == TARGET_X86_64 ? "jmp ." ASM_PROCEDURE_END_LABEL : "b ." ASM_PROCEDURE_END_LABEL);
+    for (auto& [function, compiled, cacheKey, cached] : this->procedureFunctions) {
+        if (this->options.optimizationLevel >= 1 && !reachable.contains(function.name)) {
+            this->removedFunctionCount++;
+            continue;
+        }
+        // Only functions that end up in the output count, unused ones are never stored so they would always miss
+        if (this->options.cache)
+            (cached ? this->cacheHitCount : this->cacheMissCount)++;
+        if (cached) {
+            if (this->options.sourceMap) {
+                // Lines are stored relative to the declaration, which may have moved since
+                this->emittedLines.clear();
+                for (const auto line : compiled.lines)
+                    this->emittedLines.push_back(line > 0 ? function.position.line + line - 1 : 0);
+                this->addToSourceMap(function, this->output.getLineCount() + 1, this->emittedLines);
+            }
+            this->output.writeRaw(compiled.assembly);
+            this->strings.insert(this->strings.end(), compiled.strings.begin(), compiled.strings.end());
+            continue;
+        }
+        const auto assemblyBegin = this->output.getSize();
+        const auto stringsBegin = this->strings.size();
+        // Emitting clears the function
+        const auto declarationLine = function.position.line;
+        if (auto error = this->emitFunction(function, this->output); !error.empty())
+            return error;
+        if (this->options.cache) {
+            compiled.assembly = this->output.getContents().substr(assemblyBegin);
+            compiled.strings.assign(this->strings.begin() + static_cast<std::ptrdiff_t>(stringsBegin), this->strings.end());
+            compiled.lines.clear();
+            for (const auto line : this->emittedLines)
+                compiled.lines.push_back(line > 0 ? line - declarationLine + 1 : 0);
+            this->options.cache->store(cacheKey, compiled);
+        }
+    }
+    this->procedureFunctions.clear();
+
+    this->output.setIndent(0);
+    this->output << "." ASM_PROCEDURE_END_LABEL ":";
+    // There is no simulator to stop at the end of the code
+    if (this->options.target == TARGET_X86_64) {
+        this->output.indent();
+        writeX86Exit(this->output);
+        this->output.dedent();
+    }
+
+    this->dataOffset = this->output.getSize();
+    this->writeDataBlock(this->output);
+    this->stats.emitMilliseconds = getMilliseconds(emitStart);
 
     popVariableStack();
 
     return "";
 }
 
-std::string Parser::getCodeBlock() const {
-    return this->main.getContents();
+void Parser::inlineCalls(IRFunction& function) {
+    const auto start = std::chrono::steady_clock::now();
+    if (this->options.optimizationLevel >= 1) {
+        this->evaluatedCallCount += Evaluator{function, this->pureFunctions}.run();
+        this->inlinedCallCount += Inliner{function, this->inlineFunctions}.run();
+    }
+    this->stats.optimizeMilliseconds += getMilliseconds(start);
+}
+
+void Parser::finishFunction(IRFunction& function) {
+    const auto start = std::chrono::steady_clock::now();
+    function.buildBlocks();
+    if (this->options.optimizationLevel >= 1)
+        this->optimizerRemovedCount += IROptimizer{function}.run();
+    this->stats.optimizeMilliseconds += getMilliseconds(start);
+}
+
+void Parser::finishProcedure() {
+    auto& [function, compiled, cacheKey, cached] = this->procedureFunctions.emplace_back();
+    function = std::move(this->procedureFunction);
+    // Inlined code is part of the key, so callers are compiled again when a function they inlined changes
+    this->inlineCalls(function);
+    if (this->options.optimizationLevel >= 1) {
+        const int cost = Inliner::getCost(function);
+        if (cost >= 0 && (function.isInline || cost <= (this->options.optimizationLevel >= 2 ? IR_INLINE_LARGE_COST : IR_INLINE_SMALL_COST)))
+            this->inlineFunctions.emplace(function.name, function);
+        if (Evaluator::isPure(function, this->pureFunctions))
+            this->pureFunctions.emplace(function.name, function);
+    }
+    if (this->options.cache) {
+        cacheKey = FunctionCache::getKey(function, this->options.optimizationLevel, this->options.target);
+        cached = this->options.cache->load(cacheKey, compiled);
+        if (cached)
+            return;
+    }
+    this->finishFunction(function);
+    compiled.definedLabels = function.getDefinedLabels();
+    compiled.referencedLabels = function.getReferencedLabels();
+}
+
+std::string Parser::emitFunction(IRFunction& function, FileWriter& writer) {
+    std::vector<MachineInstruction> code;
+    const int virtualRegisterCount = Lowering{function, code, this->options.optimizationLevel >= 1}.run();
+    RegisterAllocator allocator{code, virtualRegisterCount, function.isProcedure};
+    if (auto error = allocator.run(); !error.empty())
+        return error;
+    this->stats.spilledRegisters += allocator.getSpilledCount();
+    this->stats.spillInstructions += allocator.getSpillInstructionCount();
+    this->stats.callSites += allocator.getCallCount();
+    this->stats.callerSaves += allocator.getSavedRegisterCount();
+    // Remember where each variable ended up, the ones the optimizer added have no symbol
+    for (int variable = 0; variable < function.symbols.size(); variable++) {
+        auto& symbol = this->symbolTable.getSymbol(function.symbols[variable]);
+        if (variable == IR_RETURN_VARIABLE) {
+            symbol.physicalRegister = ASM_REGISTER_RETURN_VALUE;
+        } else {
+            const auto& interval = allocator.getInterval(variable - 1);
+            symbol.physicalRegister = interval.physicalRegister;
+            symbol.spillSlot = interval.spillSlot;
+        }
+    }
+    if (this->options.optimizationLevel >= 1)
+        this->peepholeRemovedCount += PeepholeOptimizer{code}.run();
+    const auto firstLine = writer.getLineCount() + 1;
+    this->emittedLines.clear();
+    if (this->options.target == TARGET_X86_64)
+        writeX86Instructions(writer, code, &this->emittedLines);
+    else
+        writeInstructions(writer, code, &this->emittedLines);
+    if (this->options.sourceMap)
+        this->addToSourceMap(function, firstLine, this->emittedLines);
+    for (auto& str : function.strings)
+        this->strings.emplace_back(getStringLabel(str), std::move(str));
+    function = IRFunction{};
+    return "";
+}
+
+void Parser::addToSourceMap(const IRFunction& function, std::size_t firstLine, const std::vector<uint32_t>& lines) {
+    this->sourceMap.addFunction(function.isProcedure ? function.name : "_start");
+    for (int i = 0; i < lines.size(); i++) {
+        if (lines[i] > 0)
+            this->sourceMap.add(static_cast<uint32_t>(firstLine + i), {function.position.file, lines[i]});
+    }
+}
+
+std::unique_ptr<Expression> Parser::parseExpression(std::span<const std::string_view> tokens, std::size_t begin, std::size_t end) {
+    if (begin >= end)
+        return nullptr;
+    // Tokens are views into the same line, so the expression is everything from the first to the end of the last
+    const auto* first = tokens[begin].data();
+    const std::string_view expression{first, static_cast<std::size_t>(tokens[end - 1].data() + tokens[end - 1].size() - first)};
+    return ExpressionParser{expression, [this](std::string_view token, IRValue& value) {
+        const auto type = this->parseValue(token, value);
+        return type != VALUE_ERROR && type != VALUE_FUNCTION;
+    }}.parse();
+}
+
+IRValue Parser::emitExpression(const Expression& expression, int base, const IRValue& dst) {
+    if (expression.isLeaf()) {
+        if (dst.type != IR_VALUE_NONE)
+            this->emit({.opcode = IR_MOVE, .dst = dst, .operands = {expression.value}});
+        return expression.value;
+    }
+
+    // Evaluate the side needing more temporaries first, its result then only holds on to one of them
+    const bool rightFirst = expression.right->temporaryCount > expression.left->temporaryCount;
+    const auto& first = rightFirst ? *expression.right : *expression.left;
+    const auto& second = rightFirst ? *expression.left : *expression.right;
+    const auto firstValue = this->emitExpression(first, base);
+    const auto secondValue = this->emitExpression(second, first.isLeaf() ? base : base + 1);
+
+    // Only the root is written to the destination, so it can still be read by the rest of the expression
+    const auto result = dst.type != IR_VALUE_NONE ? dst : this->getTemporary(base);
+    IRInstruction instr{.opcode = expression.opcode, .dst = result};
+    instr.operands = rightFirst ? std::vector{secondValue, firstValue} : std::vector{firstValue, secondValue};
+    this->emit(std::move(instr));
+    return result;
+}
+
+bool Parser::emitConditionalBranch(std::span<const std::string_view> tokens, std::size_t begin, const std::string& label) {
+    for (auto i = begin + 1; i + 1 < tokens.size(); i++) {
+        IRCondition condition;
+        if (!parseLogicalOperator(tokens[i], condition))
+            continue;
+        auto left = this->parseExpression(tokens, begin, i);
+        auto right = this->parseExpression(tokens, i + 1, tokens.size());
+        if (!left || !right)
+            return false;
+        const auto value1 = this->emitExpression(*left, 0);
+        const auto value2 = this->emitExpression(*right, left->isLeaf() ? 0 : 1);
+        this->emit({.opcode = IR_BRANCH, .operands = {value1, value2}, .condition = condition, .label = label});
+        return true;
+    }
+    return false;
+}
+
+std::string Parser::getLocalName(std::string_view prefix) {
+    auto& function = this->activeFunction();
+    return function.getLocalName(prefix, function.labelCount++);
 }
 
-std::string Parser::getProcedureBlock() const {
-    return this->procedures.getContents();
+IRValue Parser::getTemporary(int index) {
+    // Temporaries are named so they can't clash with any identifier, and are shared by every expression in a function
+    const auto name = "$" + std::to_string(index);
+    if (const auto* symbol = this->symbolTable.findVariable(this->symbolTable.intern(name)))
+        return IRValue::variable(symbol->variable);
+    return this->declareVariable(name);
 }
 
-std::string Parser::getDataBlock() const {
-    FileWriter out;
-    out << ".data";
-    int strNum = 0;
-    for (const auto& str : this->strings) {
-        out << ASM_STRING_PREFIX + std::to_string(strNum) + ": .asciz \"" + str + '\"';
-        out << ASM_STRING_PREFIX + std::to_string(strNum) + "_len = .-" ASM_STRING_PREFIX + std::to_string(strNum);
-        strNum++;
+IRValue Parser::declareVariable(std::string_view name) {
+    auto& function = this->activeFunction();
+    const int variable = function.variableCount++;
+    function.symbols.push_back(this->symbolTable.declareVariable(this->symbolTable.intern(name), variable));
+    return IRValue::variable(variable);
+}
+
+void Parser::writeDataBlock(FileWriter& writer) {
+    writer << ".data";
+    // Labels are named after their contents, so every function printing the same text shares one copy
+    std::unordered_set<std::string_view> written;
+    for (const auto& [label, str] : this->strings) {
+        if (!written.insert(label).second)
+            continue;
+        this->stats.strings++;
+        this->stats.stringBytes += str.size();
+        auto& line = writer.beginLine();
+        line += label;
+        // GNU as counts the terminator of .asciz in the length, x86-64 output is assembled with it and has no use for one
+        line += this->options.target == TARGET_X86_64 ? ": .ascii \"" : ": .asciz \"";
+        line += str;
+        line += '\"';
+        writer.endLine();
+        auto& length = writer.beginLine();
+        length += label;
+        length += "_len = .-";
+        length += label;
+        writer.endLine();
     }
-    return out.getContents();
+    // They only live on in the output now
+    this->strings.clear();
+    if (this->options.target == TARGET_X86_64)
+        writeX86RegisterFile(writer);
+}
+
+std::string_view Parser::getCodeBlock() const {
+    return this->getAssembly().substr(0, this->procedureOffset);
+}
+
+std::string_view Parser::getProcedureBlock() const {
+    return this->getAssembly().substr(this->procedureOffset, this->dataOffset - this->procedureOffset);
+}
+
+std::string_view Parser::getDataBlock() const {
+    return this->getAssembly().substr(this->dataOffset);
+}
+
+std::string_view Parser::getAssembly() const {
+    return this->output.getContents();
+}
+
+int Parser::getOptimizerRemovedCount() const {
+    return this->optimizerRemovedCount;
+}
+
+int Parser::getPeepholeRemovedCount() const {
+    return this->peepholeRemovedCount;
+}
+
+int Parser::getRemovedFunctionCount() const {
+    return this->removedFunctionCount;
+}
+
+int Parser::getInlinedCallCount() const {
+    return this->inlinedCallCount;
+}
+
+int Parser::getEvaluatedCallCount() const {
+    return this->evaluatedCallCount;
+}
+
+int Parser::getCacheHitCount() const {
+    return this->cacheHitCount;
+}
+
+int Parser::getCacheMissCount() const {
+    return this->cacheMissCount;
 }
 
-std::string Parser::getAssembly() const {
-    return this->getCodeBlock() + this->getProcedureBlock() + this->getDataBlock();
+const SourceMap& Parser::getSourceMap() const {
+    return this->sourceMap;
+}
+
+ParserStats Parser::getStats() const {
+    auto stats = this->stats;
+    countLines(this->getCodeBlock(), stats.codeInstructions, stats.labels);
+    countLines(this->getProcedureBlock(), stats.procedureInstructions, stats.labels);
+    return stats;
+}
+
+std::unordered_set<std::string> Parser::getReachableFunctions() const {
+    // Calls, jumps and raw asm can all lead into a function, so look for any label it defines
+    std::unordered_map<std::string, int> owners;
+    for (int i = 0; i < this->procedureFunctions.size(); i++) {
+        for (const auto& label : this->procedureFunctions[i].compiled.definedLabels)
+            owners.emplace(label, i);
+    }
+
+    std::unordered_set<std::string> reachable;
+    std::vector<std::string> worklist = this->mainFunction.getReferencedLabels();
+    while (!worklist.empty()) {
+        const auto label = std::move(worklist.back());
+        worklist.pop_back();
+        const auto owner = owners.find(label);
+        if (owner == owners.end())
+            continue;
+        const auto& [function, compiled, cacheKey, cached] = this->procedureFunctions[owner->second];
+        if (!reachable.insert(function.name).second)
+            continue;
+        worklist.insert(worklist.end(), compiled.referencedLabels.begin(), compiled.referencedLabels.end());
+    }
+    return reachable;
 }
 
-bool Parser::preprocessLine(std::string& line) {
-    while (!line.empty() && line.starts_with(' '))
-        line = line.substr(1);
+bool Parser::preprocessLine(std::string_view& line) {
+    while (line.starts_with(' '))
+        line.remove_prefix(1);
 
     if (line.empty())
         return false;
@@ -345,49 +649,75 @@ bool Parser::preprocessLine(std::string& line) {
     return true;
 }
 
-bool Parser::getFileContents(std::vector<std::string>& unparsedLines) {
-    if (!this->file.is_open())
+bool Parser::getFileContents(std::vector<SourceLine>& unparsedLines, std::vector<std::string_view>& tokens) {
+    if (!this->source.isOpen())
         return false;
-
-    // add prelude
-    auto preludeLines = splitString(prelude, '\n');
-    for (auto& line : preludeLines) {
-        if (!preprocessLine(line))
-            continue;
-        unparsedLines.push_back(line);
+    const auto contents = this->source.getContents();
+
+    // Size both up front so lexing doesn't have to grow them
+    const auto lineCount = preludeLines.size() + std::count(contents.begin(), contents.end(), '\n') + 1;
+    unparsedLines.reserve(lineCount);
+    tokens.reserve(lineCount * 4);
+
+    // add prelude, which is already preprocessed and tokenized
+    for (const auto& preludeLine : preludeLines) {
+        const auto firstToken = static_cast<uint32_t>(tokens.size());
+        tokens.insert(tokens.end(), preludeLine.tokens.begin(), preludeLine.tokens.begin() + static_cast<std::ptrdiff_t>(preludeLine.tokenCount));
+        unparsedLines.push_back({preludeLine.text, firstToken, static_cast<uint32_t>(preludeLine.tokenCount), {PRELUDE_FILE_NAME, preludeLine.line, preludeLine.column}});
     }
 
-    // add file contents
-    std::string line;
-    while (std::getline(this->file, line)) {
+    // add file contents, every line and token is a view into the mapped file
+    uint32_t lineNumber = 1;
+    for (std::size_t begin = 0; begin < contents.size(); lineNumber++) {
+        auto end = contents.find('\n', begin);
+        if (end == std::string_view::npos)
+            end = contents.size();
+        const auto rawLine = contents.substr(begin, end - begin);
+        begin = end + 1;
+        auto line = rawLine;
         if (!preprocessLine(line))
             continue;
-        unparsedLines.push_back(line);
+        const auto firstToken = static_cast<uint32_t>(tokens.size());
+        splitString(line, tokens);
+        const auto column = static_cast<uint32_t>(line.data() - rawLine.data()) + 1;
+        unparsedLines.push_back({line, firstToken, static_cast<uint32_t>(tokens.size()) - firstToken, {this->source.getPath(), lineNumber, column}});
     }
     return true;
 }
 
-bool Parser::isValidIdentifier(const std::string& value) {
+bool Parser::isValidIdentifier(std::string_view value) {
     return (std::isalpha(value[0]) || value[0] == '_') && std::all_of(value.begin(), value.end(), [](char c) {
         return std::isalnum(c) || std::isalpha(c) || c == '_';
     });
 }
 
+bool Parser::parseNumber(std::string_view value, int64_t& number) {
+    const bool hex = value.starts_with("0x");
+    const char* begin = value.data() + (hex ? 2 : 0);
+    const char* end = value.data() + value.size();
+    auto [ptr, ec] = std::from_chars(begin, end, number, hex ? 16 : 10);
+    return ec == std::errc{} && ptr == end && begin != end;
+}
+
 void Parser::pushVariableStack() {
-    this->variables.push({"_"});
+    // Functions can't see the variables of the code around them
+    this->symbolTable.pushScope(true);
+    auto& function = this->activeFunction();
+    function.symbols = {this->symbolTable.declareVariable(this->symbolTable.intern("_"), IR_RETURN_VARIABLE)};
 }
 
 void Parser::popVariableStack() {
-    this->variables.pop();
+    this->symbolTable.popScope();
 }
 
-ValueType Parser::getValueType(const std::string& value) {
+ValueType Parser::getValueType(std::string_view value) {
     if (value.empty())
         return VALUE_ERROR;
     if (isValidIdentifier(value)) {
-        if (hasVariable(value)) {
+        const auto id = this->symbolTable.intern(value);
+        if (this->symbolTable.findVariable(id)) {
             return VALUE_VARIABLE;
-        } else if (this->functions.contains(value)) {
+        } else if (this->symbolTable.findFunction(id)) {
             return VALUE_FUNCTION;
         }
         return VALUE_UNDEFINED_IDENTIFIER;
@@ -397,58 +727,67 @@ ValueType Parser::getValueType(const std::string& value) {
     return VALUE_ERROR;
 }
 
-ValueType Parser::parseValue(std::string& value) {
-    const auto result = this->getValueType(value);
+ValueType Parser::parseValue(std::string_view value, IRValue& operand) {
+    // Variables are by far the most common, so look them up first without going through getValueType
+    if (isValidIdentifier(value)) {
+        if (const auto* symbol = this->symbolTable.findVariable(this->symbolTable.intern(value))) {
+            operand = IRValue::variable(symbol->variable);
+            return VALUE_VARIABLE;
+        }
+    }
+    auto result = this->getValueType(value);
     switch (result) {
         case VALUE_ERROR:
-        case VALUE_UNDEFINED_IDENTIFIER:
         case VALUE_FUNCTION:
             break;
-        case VALUE_NUMBER:
-            value = "#" + value;
+        case VALUE_UNDEFINED_IDENTIFIER:
+            operand = IRValue::symbol(std::string{value});
             break;
-        case VALUE_VARIABLE: {
-            const auto find = std::find(this->variables.top().begin(), this->variables.top().end(), value);
-            value = "x" + std::to_string(std::distance(this->variables.top().begin(), find) + ASM_REGISTER_OFFSET);
+        case VALUE_NUMBER: {
+            int64_t number;
+            if (!parseNumber(value, number))
+                return VALUE_ERROR;
+            operand = IRValue::constant(number);
             break;
         }
+        case VALUE_VARIABLE:
+            break;
     }
     return result;
 }
 
-bool Parser::parseMathOperator(std::string& op) {
+bool Parser::parseMathOperator(std::string_view op, IROpcode& opcode) {
     if (op == "+") {
-        op = "add";
+        opcode = IR_ADD;
     } else if (op == "-") {
-        op = "sub";
+        opcode = IR_SUB;
     } else if (op == "*") {
-        op = "mul";
+        opcode = IR_MUL;
     } else if (op == "/") {
-        op = "sdiv";
+        opcode = IR_DIV;
     } else {
         return false;
     }
     return true;
 }
 
-bool Parser::parseLogicalOperator(std::string& op) {
+bool Parser::parseLogicalOperator(std::string_view op, IRCondition& condition) {
     // remember to invert the condition since we jump to the end if true
     if (op == "==") {
-        op = "ne";
+        condition = IR_CONDITION_NE;
     } else if (op == "!=") {
-        op = "eq";
+        condition = IR_CONDITION_EQ;
     } else if (op == "<") {
-        op = "ge";
+        condition = IR_CONDITION_GE;
     } else if (op == ">") {
-        op = "le";
+        condition = IR_CONDITION_LE;
     } else if (op == "<=") {
-        op = "gt";
+        condition = IR_CONDITION_GT;
     } else if (op == ">=") {
-        op = "lt";
+        condition = IR_CONDITION_LT;
     } else {
         return false;
     }
-    op = 'b' + op;
     return true;
 }
 
@@ -1,15 +1,26 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
-#include <fstream>
+#include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include <stack>
-#include <unordered_map>
 
+#include "cache.hpp"
+#include "evaluator.hpp"
+#include "expression.hpp"
 #include "filewriter.hpp"
+#include "inliner.hpp"
+#include "instruction.hpp"
+#include "ir.hpp"
 #include "prelude.hpp"
+#include "sourcefile.hpp"
+#include "sourcemap.hpp"
+#include "symboltable.hpp"
 
 enum ValueType {
     VALUE_ERROR                = 0,
@@ -19,47 +30,158 @@ enum ValueType {
     VALUE_FUNCTION             = 4,
 };
 
+struct ParserOptions {
+    // 0 disables the optimization passes
+    int optimizationLevel = 1;
+    // Functions found here aren't compiled again, can be shared between parsers
+    const FunctionCache* cache = nullptr;
+    // Record which source line each line of assembly came from
+    bool sourceMap = false;
+    Target target = TARGET_AARCH64;
+};
+
+// Where the time went and what was generated
+struct ParserStats {
+    // Wall time of each phase in milliseconds, functions are optimized while the file is parsed but that isn't counted twice
+    double readMilliseconds = 0;
+    double parseMilliseconds = 0;
+    double optimizeMilliseconds = 0;
+    double emitMilliseconds = 0;
+    // Lines parsed, the prelude included
+    std::size_t sourceLines = 0;
+    // Lines of assembly that aren't labels or directives
+    std::size_t codeInstructions = 0;
+    std::size_t procedureInstructions = 0;
+    std::size_t labels = 0;
+    // Strings in the data section and their total length, escapes are counted as they are written
+    std::size_t strings = 0;
+    std::size_t stringBytes = 0;
+    // Only counted for functions that were compiled, cached ones are copied as they are
+    std::size_t spilledRegisters = 0;
+    std::size_t spillInstructions = 0;
+    std::size_t callSites = 0;
+    std::size_t callerSaves = 0;
+};
+
+// A function that has been parsed, waiting to be emitted once it is known whether it is called
+struct PendingFunction {
+    IRFunction function;
+    // Filled in as far as it is known, the rest is stored in the cache once the function is emitted
+    CompiledFunction compiled;
+    std::string cacheKey;
+    // The function wasn't compiled, its assembly comes from the cache
+    bool cached = false;
+};
+
 class Parser {
 public:
-    explicit Parser(const std::string& filepath);
-    ~Parser();
+    explicit Parser(const std::string& filepath, ParserOptions options = {});
+    // Compiles contents instead of reading the file, errors and source maps still name the file
+    Parser(const std::string& filepath, std::string contents, ParserOptions options = {});
     [[nodiscard]] std::string parse();
-    [[nodiscard]] std::string getCodeBlock() const;
-    [[nodiscard]] std::string getProcedureBlock() const;
-    [[nodiscard]] std::string getDataBlock() const;
-    [[nodiscard]] std::string getAssembly() const;
+    // Views into the generated assembly, valid as long as the parser is
+    [[nodiscard]] std::string_view getCodeBlock() const;
+    [[nodiscard]] std::string_view getProcedureBlock() const;
+    [[nodiscard]] std::string_view getDataBlock() const;
+    [[nodiscard]] std::string_view getAssembly() const;
+    [[nodiscard]] int getOptimizerRemovedCount() const;
+    [[nodiscard]] int getPeepholeRemovedCount() const;
+    [[nodiscard]] int getRemovedFunctionCount() const;
+    [[nodiscard]] int getInlinedCallCount() const;
+    [[nodiscard]] int getEvaluatedCallCount() const;
+    [[nodiscard]] int getCacheHitCount() const;
+    [[nodiscard]] int getCacheMissCount() const;
+    // Empty unless the sourceMap option is set
+    [[nodiscard]] const SourceMap& getSourceMap() const;
+    [[nodiscard]] ParserStats getStats() const;
 private:
-    std::fstream file;
-    FileWriter main;
-    FileWriter procedures;
+    SourceFile source;
+    ParserOptions options;
+    // Position of the line being parsed, errors are reported there
+    SourcePosition position;
+    int optimizerRemovedCount = 0;
+    int peepholeRemovedCount = 0;
+    int removedFunctionCount = 0;
+    int inlinedCallCount = 0;
+    int evaluatedCallCount = 0;
+    int cacheHitCount = 0;
+    int cacheMissCount = 0;
+    ParserStats stats;
+    // The code, procedure and data sections, one after the other
+    FileWriter output;
+    std::size_t procedureOffset = 0;
+    std::size_t dataOffset = 0;
+    SourceMap sourceMap;
+    // Source line of each line of assembly written by the last call to emitFunction
+    std::vector<uint32_t> emittedLines;
 
-    static bool preprocessLine(std::string& line);
-    [[nodiscard]] bool getFileContents(std::vector<std::string>& unparsedLines);
+    [[nodiscard]] std::string parseSource();
+    static bool preprocessLine(std::string_view& line);
+    // Lines and tokens are views into the source file or the prelude, so they must not outlive this parser
+    [[nodiscard]] bool getFileContents(std::vector<SourceLine>& unparsedLines, std::vector<std::string_view>& tokens);
 
     bool insideASM = false;
     bool insideProcedure = false;
 
-    [[nodiscard]] inline FileWriter& activeCode() {
-        return this->insideProcedure ? this->procedures : this->main;
+    // Code is collected per function so it can be optimized and allocated once it is complete
+    IRFunction mainFunction;
+    IRFunction procedureFunction;
+    // Finished functions wait here until it is known which of them are called
+    std::vector<PendingFunction> procedureFunctions;
+    // Copies of the functions cheap enough to inline, taken before they are optimized
+    std::unordered_map<std::string, IRFunction> inlineFunctions;
+    // Copies of the functions that only change "_", calls to them with constant arguments are worked out while compiling
+    std::unordered_map<std::string, IRFunction> pureFunctions;
+
+    [[nodiscard]] inline IRFunction& activeFunction() {
+        return this->insideProcedure ? this->procedureFunction : this->mainFunction;
+    }
+    // Instructions copied from earlier in the source keep their line
+    inline void emit(IRInstruction instr) {
+        if (instr.line == 0)
+            instr.line = this->position.line;
+        this->activeFunction().code.push_back(std::move(instr));
     }
+    // Replaces calls to any function in pureFunctions with constant arguments by their result, then calls to any function
+    // in inlineFunctions with its code
+    void inlineCalls(IRFunction& function);
+    void finishFunction(IRFunction& function);
+    // Moves the procedure that just ended into procedureFunctions, optimizing it unless it is cached
+    void finishProcedure();
+    [[nodiscard]] std::string emitFunction(IRFunction& function, FileWriter& writer);
+    // Adds the lines of a function starting at firstLine of the assembly to the source map
+    void addToSourceMap(const IRFunction& function, std::size_t firstLine, const std::vector<uint32_t>& lines);
+    // Names of the functions the main code can end up calling
+    [[nodiscard]] std::unordered_set<std::string> getReachableFunctions() const;
 
-    std::vector<std::string> strings;
-    std::stack<std::vector<std::string>> variables;
-    std::unordered_map<std::string, std::vector<std::string>> functions;
+    // Parses tokens [begin, end) as an arithmetic expression, returns nullptr on a syntax error
+    [[nodiscard]] std::unique_ptr<Expression> parseExpression(std::span<const std::string_view> tokens, std::size_t begin, std::size_t end);
+    // Emits the code for an expression using temporaries from base upwards, returns the value holding the result
+    IRValue emitExpression(const Expression& expression, int base, const IRValue& dst = {});
+    // Emits a branch to label taken when the "<expression> <operator> <expression>" starting at begin is false
+    [[nodiscard]] bool emitConditionalBranch(std::span<const std::string_view> tokens, std::size_t begin, const std::string& label);
+    [[nodiscard]] IRValue getTemporary(int index);
+    // Labels and strings are numbered per function
+    [[nodiscard]] std::string getLocalName(std::string_view prefix);
 
-    [[nodiscard]] inline bool hasVariable(const std::string& varName) const {
-        return std::find(this->variables.top().begin(), this->variables.top().end(), varName) != this->variables.top().end();
-    }
+    // Data label and contents of every string in the program, functions printing the same text list it more than once
+    std::vector<std::pair<std::string, std::string>> strings;
+    void writeDataBlock(FileWriter& writer);
+    SymbolTable symbolTable;
+
+    // Declares a variable in the current function and scope
+    IRValue declareVariable(std::string_view name);
 
-    [[nodiscard]] static bool isValidIdentifier(const std::string& value);
+    [[nodiscard]] static bool isValidIdentifier(std::string_view value);
+    [[nodiscard]] static bool parseNumber(std::string_view value, int64_t& number);
 
     void pushVariableStack();
     void popVariableStack();
 
-    [[nodiscard]] ValueType getValueType(const std::string& value);
-    ValueType parseValue(std::string& value);
+    [[nodiscard]] ValueType getValueType(std::string_view value);
+    ValueType parseValue(std::string_view value, IRValue& operand);
 
-    [[nodiscard]] static bool parseMathOperator(std::string& op);
-    [[nodiscard]] static bool parseLogicalOperator(std::string& op);
+    [[nodiscard]] static bool parseMathOperator(std::string_view op, IROpcode& opcode);
+    [[nodiscard]] static bool parseLogicalOperator(std::string_view op, IRCondition& condition);
     [[nodiscard]] static bool parseStringLiteral(std::string& literal);
 };
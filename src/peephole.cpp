@@ -0,0 +1,122 @@
+#include "peephole.hpp"
+
+#include <algorithm>
+
+namespace {
+
+bool isRegisterOperand(const MachineOperand& operand) {
+    return operand.type == OPERAND_REGISTER;
+}
+
+bool isStackAdjust(const MachineInstruction& instr, Mnemonic mnemonic) {
+    return instr.mnemonic == mnemonic && instr.operands.size() == 3 && instr.operands[0].isRegister(ASM_REGISTER_SP)
+           && instr.operands[1].isRegister(ASM_REGISTER_SP) && instr.operands[2].type == OPERAND_IMMEDIATE;
+}
+
+bool readsOperand(const MachineInstruction& instr, const MachineOperand& operand) {
+    const auto first = instr.definesFirstOperand() ? instr.operands.begin() + 1 : instr.operands.begin();
+    return std::any_of(first, instr.operands.end(), [&operand](const MachineOperand& other) {
+        return other == operand || (other.type == OPERAND_MEMORY && operand.type == OPERAND_REGISTER && other.base == operand.value);
+    });
+}
+
+} // namespace
+
+PeepholeOptimizer::PeepholeOptimizer(std::vector<MachineInstruction>& code_)
+        : code(code_) {}
+
+int PeepholeOptimizer::run() {
+    const auto originalSize = this->code.size();
+    for (bool changed = true; changed;) {
+        std::vector<MachineInstruction> out;
+        out.reserve(this->code.size());
+        changed = false;
+        // Nothing after an unconditional branch runs until the next label
+        bool unreachable = false;
+        for (auto& instr : this->code) {
+            if (instr.mnemonic == MNEMONIC_LABEL || instr.mnemonic == MNEMONIC_RAW)
+                unreachable = false;
+            if (unreachable) {
+                changed = true;
+                continue;
+            }
+            if (combine(out, instr)) {
+                changed = true;
+                continue;
+            }
+            unreachable = instr.mnemonic == MNEMONIC_B || instr.mnemonic == MNEMONIC_RET;
+            out.push_back(std::move(instr));
+        }
+        this->code = std::move(out);
+    }
+    return static_cast<int>(originalSize - this->code.size());
+}
+
+bool PeepholeOptimizer::combine(std::vector<MachineInstruction>& out, MachineInstruction& instr) {
+    // mov xN, xN
+    if (instr.mnemonic == MNEMONIC_MOV && instr.operands[0] == instr.operands[1])
+        return true;
+    if (out.empty())
+        return false;
+    auto& prev = out.back();
+
+    // mov a, b / mov b, a -> mov a, b
+    if (instr.mnemonic == MNEMONIC_MOV && prev.mnemonic == MNEMONIC_MOV && instr.operands[0] == prev.operands[1] && instr.operands[1] == prev.operands[0])
+        return true;
+
+    // mov a, x / op a, ... (not reading a) -> op a, ...
+    if (prev.mnemonic == MNEMONIC_MOV && isRegisterOperand(prev.operands[0]) && instr.definesFirstOperand() && instr.mnemonic != MNEMONIC_LDR
+        && instr.operands[0] == prev.operands[0] && !readsOperand(instr, prev.operands[0])) {
+        prev = std::move(instr);
+        return true;
+    }
+
+    // b label / label: -> label:
+    if (instr.mnemonic == MNEMONIC_LABEL && prev.mnemonic == MNEMONIC_B && prev.operands[0].name == instr.operands[0].name) {
+        prev = std::move(instr);
+        return true;
+    }
+
+    // add sp, sp, #n / sub sp, sp, #n (or the reverse) cancel out
+    if (((isStackAdjust(prev, MNEMONIC_ADD) && isStackAdjust(instr, MNEMONIC_SUB)) || (isStackAdjust(prev, MNEMONIC_SUB) && isStackAdjust(instr, MNEMONIC_ADD)))
+        && prev.operands[2] == instr.operands[2]) {
+        out.pop_back();
+        return true;
+    }
+
+    // str a, [m] / ldr b, [m] -> str a, [m] / mov b, a
+    if (instr.mnemonic == MNEMONIC_LDR && prev.mnemonic == MNEMONIC_STR && instr.operands[1].type == OPERAND_MEMORY && instr.operands[1].mode == ADDRESS_OFFSET
+        && instr.operands[1] == prev.operands[1]) {
+        if (instr.operands[0] == prev.operands[0])
+            return true;
+        // Rewritten in place so it keeps its source line
+        instr.mnemonic = MNEMONIC_MOV;
+        instr.operands = {instr.operands[0], prev.operands[0]};
+        return false;
+    }
+
+    // stp a, b, [m] / ldp a, b, [m] -> stp a, b, [m]
+    if (instr.mnemonic == MNEMONIC_LDP && prev.mnemonic == MNEMONIC_STP && instr.operands[2].mode == ADDRESS_OFFSET && instr.operands == prev.operands)
+        return true;
+
+    // Push immediately followed by a pop of the same size
+    if (instr.mnemonic == MNEMONIC_LDR && prev.mnemonic == MNEMONIC_STR && instr.operands[1].type == OPERAND_MEMORY && prev.operands[1].type == OPERAND_MEMORY
+        && prev.operands[1].mode == ADDRESS_PRE_INDEX && instr.operands[1].mode == ADDRESS_POST_INDEX
+        && prev.operands[1].base == instr.operands[1].base && prev.operands[1].value == -instr.operands[1].value) {
+        auto value = prev.operands[0];
+        out.pop_back();
+        if (instr.operands[0] == value)
+            return true;
+        instr.mnemonic = MNEMONIC_MOV;
+        instr.operands = {instr.operands[0], value};
+        return false;
+    }
+    if (instr.mnemonic == MNEMONIC_LDP && prev.mnemonic == MNEMONIC_STP && prev.operands[2].mode == ADDRESS_PRE_INDEX && instr.operands[2].mode == ADDRESS_POST_INDEX
+        && prev.operands[2].base == instr.operands[2].base && prev.operands[2].value == -instr.operands[2].value
+        && prev.operands[0] == instr.operands[0] && prev.operands[1] == instr.operands[1]) {
+        out.pop_back();
+        return true;
+    }
+
+    return false;
+}
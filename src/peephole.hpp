@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+
+#include "instruction.hpp"
+
+class PeepholeOptimizer {
+public:
+    explicit PeepholeOptimizer(std::vector<MachineInstruction>& code);
+    // Rewrites the code until no pattern matches, returns how many instructions were removed
+    int run();
+private:
+    std::vector<MachineInstruction>& code;
+
+    [[nodiscard]] static bool combine(std::vector<MachineInstruction>& out, MachineInstruction& instr);
+};
@@ -1,5 +1,14 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#define PRELUDE_FILE_NAME "prelude.hpp"
+
+// Line of prelude.hpp the prelude string starts on, so errors and source maps can point into this file
+constexpr uint32_t preludeFirstLine = __LINE__ + 1;
 constexpr const auto prelude = R"(
 func pow base exp
     let out = base
@@ -44,10 +53,90 @@ func gcd x y
         if x > y
             x -= y
         end
-        if x <= y
+        if x < y
             y -= x
         end
     end
     return y
 end
 )";
+
+// The prelude is split into lines and tokens while compiling the compiler, so it costs nothing at startup.
+// Lines are preprocessed and tokenized the same way as the user's file is.
+
+namespace detail {
+
+template<typename F>
+constexpr void forEachPreludeLine(F&& callback) {
+    const std::string_view source{prelude};
+    uint32_t lineNumber = preludeFirstLine;
+    for (std::size_t begin = 0; begin < source.size(); lineNumber++) {
+        auto end = source.find('\n', begin);
+        if (end == std::string_view::npos)
+            end = source.size();
+        auto line = source.substr(begin, end - begin);
+        begin = end + 1;
+        uint32_t column = 1;
+        for (; line.starts_with(' '); column++)
+            line.remove_prefix(1);
+        if (!line.empty() && !line.starts_with("//"))
+            callback(line, lineNumber, column);
+    }
+}
+
+template<typename F>
+constexpr void forEachPreludeToken(std::string_view line, F&& callback) {
+    // Consecutive spaces produce empty tokens, a trailing one doesn't, just like splitString
+    for (std::size_t begin = 0; begin < line.size();) {
+        auto end = line.find(' ', begin);
+        if (end == std::string_view::npos)
+            end = line.size();
+        callback(line.substr(begin, end - begin));
+        begin = end + 1;
+    }
+}
+
+constexpr std::size_t countPreludeLines() {
+    std::size_t count = 0;
+    forEachPreludeLine([&count](std::string_view, uint32_t, uint32_t) {
+        count++;
+    });
+    return count;
+}
+
+constexpr std::size_t countPreludeMaxTokens() {
+    std::size_t max = 0;
+    forEachPreludeLine([&max](std::string_view line, uint32_t, uint32_t) {
+        std::size_t count = 0;
+        forEachPreludeToken(line, [&count](std::string_view) {
+            count++;
+        });
+        max = count > max ? count : max;
+    });
+    return max;
+}
+
+} // namespace detail
+
+struct PreludeLine {
+    std::string_view text;
+    std::array<std::string_view, detail::countPreludeMaxTokens()> tokens{};
+    std::size_t tokenCount = 0;
+    uint32_t line = 0;
+    uint32_t column = 0;
+};
+
+constexpr auto preludeLines = [] {
+    std::array<PreludeLine, detail::countPreludeLines()> out{};
+    std::size_t i = 0;
+    detail::forEachPreludeLine([&out, &i](std::string_view line, uint32_t lineNumber, uint32_t column) {
+        auto& entry = out[i++];
+        entry.text = line;
+        entry.line = lineNumber;
+        entry.column = column;
+        detail::forEachPreludeToken(line, [&entry](std::string_view token) {
+            entry.tokens[entry.tokenCount++] = token;
+        });
+    });
+    return out;
+}();
@@ -0,0 +1,421 @@
+#include "regalloc.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+
+// Caller-saved registers available to variables, in order of preference
+#define ALLOC_FIRST_REGISTER 11
+#define ALLOC_LAST_REGISTER 28
+// Intra-procedure-call scratch registers, reserved for spill code once anything is spilled
+#define ALLOC_SCRATCH_REGISTER_0 16
+#define ALLOC_SCRATCH_REGISTER_1 17
+// Raw asm lines and multiply-accumulates can read more than two values, so they may borrow the math helper too
+#define ALLOC_SCRATCH_REGISTER_2 9
+
+namespace {
+
+struct BitSet {
+    std::vector<uint64_t> words;
+
+    explicit BitSet(int size = 0)
+            : words((size + 63) / 64, 0) {}
+
+    [[nodiscard]] bool test(int i) const {
+        return (this->words[i / 64] >> (i % 64)) & 1;
+    }
+    void set(int i) {
+        this->words[i / 64] |= uint64_t{1} << (i % 64);
+    }
+    void reset(int i) {
+        this->words[i / 64] &= ~(uint64_t{1} << (i % 64));
+    }
+    void fill() {
+        std::fill(this->words.begin(), this->words.end(), ~uint64_t{0});
+    }
+    template<typename F>
+    void forEach(F&& callback) const {
+        for (int w = 0; w < this->words.size(); w++) {
+            for (uint64_t bits = this->words[w]; bits; bits &= bits - 1)
+                callback(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+};
+
+struct BasicBlock {
+    int from = 0;
+    int to = 0;
+    std::vector<int> successors;
+    bool exitsToUnknownLabel = false;
+    BitSet use, def, liveIn, liveOut;
+};
+
+bool isUse(const MachineInstruction& instr, int operand) {
+    return instr.mnemonic == MNEMONIC_RAW || operand != 0 || !instr.definesFirstOperand();
+}
+
+bool isDef(const MachineInstruction& instr, int operand) {
+    return instr.mnemonic == MNEMONIC_RAW || (operand == 0 && instr.definesFirstOperand());
+}
+
+} // namespace
+
+RegisterAllocator::RegisterAllocator(std::vector<MachineInstruction>& code_, int virtualRegisterCount_, bool isProcedure_)
+        : code(code_)
+        , virtualRegisterCount(virtualRegisterCount_)
+        , isProcedure(isProcedure_) {}
+
+std::string RegisterAllocator::run() {
+    this->isLeaf = std::none_of(this->code.begin(), this->code.end(), [](const MachineInstruction& instr) {
+        // Raw asm can call functions too
+        return instr.mnemonic == MNEMONIC_CALL || (instr.mnemonic == MNEMONIC_RAW && instr.text.starts_with("bl "));
+    });
+    this->computeLiveIntervals();
+
+    std::vector<int> pool;
+    for (int i = ALLOC_FIRST_REGISTER; i <= ALLOC_LAST_REGISTER; i++)
+        pool.push_back(i);
+    this->linearScan(pool);
+
+    if (this->spillSlots > 0) {
+        // Spill code needs scratch registers, try again without them
+        std::erase(pool, ALLOC_SCRATCH_REGISTER_0);
+        std::erase(pool, ALLOC_SCRATCH_REGISTER_1);
+        this->linearScan(pool);
+    }
+
+    return this->rewrite();
+}
+
+const LiveInterval& RegisterAllocator::getInterval(int virtualRegister) const {
+    return this->intervals[virtualRegister];
+}
+
+int RegisterAllocator::getSpilledCount() const {
+    return this->spillSlots;
+}
+
+int RegisterAllocator::getSpillInstructionCount() const {
+    return this->spillInstructionCount;
+}
+
+int RegisterAllocator::getCallCount() const {
+    return this->callCount;
+}
+
+int RegisterAllocator::getSavedRegisterCount() const {
+    return this->savedRegisterCount;
+}
+
+void RegisterAllocator::computeLiveIntervals() {
+    const int count = static_cast<int>(this->code.size());
+
+    // Split the code into basic blocks
+    std::vector<BasicBlock> blocks;
+    std::unordered_map<std::string, int> labelBlocks;
+    for (int i = 0; i < count; i++) {
+        const auto& instr = this->code[i];
+        const bool leader = i == 0 || instr.mnemonic == MNEMONIC_LABEL || this->code[i - 1].endsControlFlow() || this->code[i - 1].isConditionalBranch();
+        if (leader) {
+            if (!blocks.empty())
+                blocks.back().to = i - 1;
+            blocks.emplace_back();
+            blocks.back().from = i;
+        }
+        if (instr.mnemonic == MNEMONIC_LABEL)
+            labelBlocks[instr.operands[0].name] = static_cast<int>(blocks.size()) - 1;
+    }
+    if (!blocks.empty())
+        blocks.back().to = count - 1;
+
+    for (int b = 0; b < blocks.size(); b++) {
+        auto& block = blocks[b];
+        const auto& last = this->code[block.to];
+        if (last.mnemonic == MNEMONIC_B || last.isConditionalBranch()) {
+            // cbz and cbnz test a register first, the label is always last
+            if (auto target = labelBlocks.find(last.operands.back().name); target != labelBlocks.end())
+                block.successors.push_back(target->second);
+            else
+                block.exitsToUnknownLabel = true;
+        }
+        if (!last.endsControlFlow() && b + 1 < blocks.size())
+            block.successors.push_back(b + 1);
+
+        block.use = block.def = block.liveIn = block.liveOut = BitSet{this->virtualRegisterCount};
+        for (int i = block.from; i <= block.to; i++) {
+            const auto& instr = this->code[i];
+            for (int o = 0; o < instr.operands.size(); o++) {
+                if (instr.operands[o].type == OPERAND_VIRTUAL && isUse(instr, o) && !block.def.test(static_cast<int>(instr.operands[o].value)))
+                    block.use.set(static_cast<int>(instr.operands[o].value));
+            }
+            for (int o = 0; o < instr.operands.size(); o++) {
+                if (instr.operands[o].type == OPERAND_VIRTUAL && isDef(instr, o))
+                    block.def.set(static_cast<int>(instr.operands[o].value));
+            }
+        }
+        // Jumping somewhere we can't see, so everything has to stay alive
+        if (block.exitsToUnknownLabel)
+            block.liveOut.fill();
+    }
+
+    // Iterate liveness to a fixed point
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int b = static_cast<int>(blocks.size()) - 1; b >= 0; b--) {
+            auto& block = blocks[b];
+            for (int s : block.successors) {
+                for (int w = 0; w < block.liveOut.words.size(); w++)
+                    block.liveOut.words[w] |= blocks[s].liveIn.words[w];
+            }
+            for (int w = 0; w < block.liveIn.words.size(); w++) {
+                const uint64_t in = block.use.words[w] | (block.liveOut.words[w] & ~block.def.words[w]);
+                if (in != block.liveIn.words[w]) {
+                    block.liveIn.words[w] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Build one interval per virtual register covering every point where it is live
+    this->intervals.assign(this->virtualRegisterCount, {});
+    for (int v = 0; v < this->virtualRegisterCount; v++)
+        this->intervals[v].virtualRegister = v;
+    auto extend = [this](int v, int from, int to) {
+        auto& interval = this->intervals[v];
+        interval.start = interval.start < 0 ? from : std::min(interval.start, from);
+        interval.end = std::max(interval.end, to);
+    };
+
+    std::vector<int> openUntil(this->virtualRegisterCount, -1);
+    this->liveAfterCall.clear();
+    for (const auto& block : blocks) {
+        std::vector<int> open;
+        block.liveOut.forEach([&](int v) {
+            if (v < this->virtualRegisterCount) {
+                openUntil[v] = block.to;
+                open.push_back(v);
+            }
+        });
+        for (int i = block.to; i >= block.from; i--) {
+            const auto& instr = this->code[i];
+            if (instr.mnemonic == MNEMONIC_CALL) {
+                auto& live = this->liveAfterCall[i];
+                for (int v : open) {
+                    if (openUntil[v] >= 0 && std::find(live.begin(), live.end(), v) == live.end())
+                        live.push_back(v);
+                }
+            }
+            for (int o = 0; o < instr.operands.size(); o++) {
+                if (instr.operands[o].type != OPERAND_VIRTUAL || !isDef(instr, o))
+                    continue;
+                const auto v = static_cast<int>(instr.operands[o].value);
+                extend(v, i, openUntil[v] >= 0 ? openUntil[v] : i);
+                openUntil[v] = -1;
+            }
+            for (int o = 0; o < instr.operands.size(); o++) {
+                if (instr.operands[o].type != OPERAND_VIRTUAL || !isUse(instr, o))
+                    continue;
+                const auto v = static_cast<int>(instr.operands[o].value);
+                if (openUntil[v] < 0) {
+                    openUntil[v] = i;
+                    open.push_back(v);
+                }
+            }
+        }
+        for (int v : open) {
+            if (openUntil[v] >= 0) {
+                extend(v, block.from, openUntil[v]);
+                openUntil[v] = -1;
+            }
+        }
+    }
+}
+
+void RegisterAllocator::linearScan(const std::vector<int>& pool) {
+    this->spillSlots = 0;
+    std::vector<LiveInterval*> order;
+    for (auto& interval : this->intervals) {
+        interval.physicalRegister = -1;
+        interval.spillSlot = -1;
+        if (interval.start >= 0)
+            order.push_back(&interval);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const LiveInterval* a, const LiveInterval* b) {
+        return a->start < b->start;
+    });
+
+    // Active intervals are kept sorted by increasing end point
+    std::vector<LiveInterval*> active;
+    std::vector<int> free{pool.rbegin(), pool.rend()};
+    auto insertActive = [&active](LiveInterval* interval) {
+        active.insert(std::upper_bound(active.begin(), active.end(), interval, [](const LiveInterval* a, const LiveInterval* b) {
+            return a->end < b->end;
+        }), interval);
+    };
+    auto release = [&free, &pool](int reg) {
+        // Keep the preferred (lowest) registers at the back so they are reused first
+        const auto rank = std::find(pool.begin(), pool.end(), reg) - pool.begin();
+        free.insert(std::find_if(free.begin(), free.end(), [&pool, rank](int other) {
+            return std::find(pool.begin(), pool.end(), other) - pool.begin() < rank;
+        }), reg);
+    };
+
+    for (auto* interval : order) {
+        while (!active.empty() && active.front()->end < interval->start) {
+            release(active.front()->physicalRegister);
+            active.erase(active.begin());
+        }
+        if (!free.empty()) {
+            interval->physicalRegister = free.back();
+            free.pop_back();
+            insertActive(interval);
+            continue;
+        }
+        // Spill whichever interval lives the longest
+        auto* victim = active.back();
+        if (victim->end > interval->end) {
+            interval->physicalRegister = victim->physicalRegister;
+            victim->physicalRegister = -1;
+            victim->spillSlot = this->spillSlots++;
+            active.pop_back();
+            insertActive(interval);
+        } else {
+            interval->spillSlot = this->spillSlots++;
+        }
+    }
+}
+
+std::vector<int> RegisterAllocator::getCallerSavedRegisters(int pos) const {
+    // Spilled values already live in the frame, only registers need saving
+    std::vector<int> saved;
+    if (auto live = this->liveAfterCall.find(pos); live != this->liveAfterCall.end()) {
+        for (int v : live->second) {
+            if (this->intervals[v].physicalRegister >= 0)
+                saved.push_back(this->intervals[v].physicalRegister);
+        }
+    }
+    std::sort(saved.begin(), saved.end());
+    return saved;
+}
+
+int RegisterAllocator::getSaveAreaSize() const {
+    std::size_t saves = 0;
+    for (const auto& [pos, live] : this->liveAfterCall)
+        saves = std::max(saves, this->getCallerSavedRegisters(pos).size());
+    return static_cast<int>(saves) * 8;
+}
+
+std::string RegisterAllocator::rewrite() {
+    // The frame holds the caller-save area at the bottom, followed by spill slots.
+    // sp must stay 16 byte aligned
+    const int spillBase = (this->getSaveAreaSize() + 15) / 16 * 16;
+    const int frameSize = spillBase + (this->spillSlots * 8 + 15) / 16 * 16;
+    const bool saveLinkRegister = this->isProcedure && !this->isLeaf;
+    std::vector<MachineInstruction> out;
+    out.reserve(this->code.size());
+
+    // Everything an instruction turns into comes from the same source line
+    std::size_t rewritten = 0;
+    uint32_t line = 0;
+    const auto setLines = [&out, &rewritten, &line] {
+        for (; rewritten < out.size(); rewritten++)
+            out[rewritten].line = line;
+    };
+
+    for (int pos = 0; pos < this->code.size(); pos++) {
+        setLines();
+        auto& instr = this->code[pos];
+        line = instr.line;
+        switch (instr.mnemonic) {
+            case MNEMONIC_PROLOGUE:
+                if (saveLinkRegister)
+                    out.emplace_back(MNEMONIC_STR, std::vector{MachineOperand::reg(ASM_REGISTER_LR), MachineOperand::memory(ASM_REGISTER_SP, -0x10, ADDRESS_PRE_INDEX)});
+                if (frameSize > 0)
+                    out.emplace_back(MNEMONIC_SUB, std::vector{MachineOperand::reg(ASM_REGISTER_SP), MachineOperand::reg(ASM_REGISTER_SP), MachineOperand::imm(frameSize)});
+                continue;
+            case MNEMONIC_RETURN:
+            case MNEMONIC_TAIL_CALL:
+                if (frameSize > 0)
+                    out.emplace_back(MNEMONIC_ADD, std::vector{MachineOperand::reg(ASM_REGISTER_SP), MachineOperand::reg(ASM_REGISTER_SP), MachineOperand::imm(frameSize)});
+                if (saveLinkRegister)
+                    out.emplace_back(MNEMONIC_LDR, std::vector{MachineOperand::reg(ASM_REGISTER_LR), MachineOperand::memory(ASM_REGISTER_SP, 0x10, ADDRESS_POST_INDEX)});
+                // A tail call leaves lr pointing at our caller, so the callee returns there
+                if (instr.mnemonic == MNEMONIC_TAIL_CALL)
+                    out.emplace_back(MNEMONIC_B, std::vector{instr.operands[0]});
+                else
+                    out.emplace_back(MNEMONIC_RET);
+                continue;
+            case MNEMONIC_CALL: {
+                // Callees may clobber every register, so save the ones holding values we need afterwards.
+                // The save area is already part of the frame, so no stack adjustment is needed here
+                const auto saved = this->getCallerSavedRegisters(pos);
+                this->callCount++;
+                this->savedRegisterCount += static_cast<int>(saved.size());
+                for (int i = 0; i < saved.size(); i += 2) {
+                    const auto slot = MachineOperand::memory(ASM_REGISTER_SP, i * 8);
+                    if (i + 1 < saved.size())
+                        out.emplace_back(MNEMONIC_STP, std::vector{MachineOperand::reg(saved[i]), MachineOperand::reg(saved[i + 1]), slot});
+                    else
+                        out.emplace_back(MNEMONIC_STR, std::vector{MachineOperand::reg(saved[i]), slot});
+                }
+                out.emplace_back(MNEMONIC_BL, std::vector{instr.operands[0]});
+                for (int i = 0; i < saved.size(); i += 2) {
+                    const auto slot = MachineOperand::memory(ASM_REGISTER_SP, i * 8);
+                    if (i + 1 < saved.size())
+                        out.emplace_back(MNEMONIC_LDP, std::vector{MachineOperand::reg(saved[i]), MachineOperand::reg(saved[i + 1]), slot});
+                    else
+                        out.emplace_back(MNEMONIC_LDR, std::vector{MachineOperand::reg(saved[i]), slot});
+                }
+                continue;
+            }
+            default:
+                break;
+        }
+
+        // Spilled values are loaded into scratch registers before the instruction and stored back afterwards
+        std::vector<MachineInstruction> loads, stores;
+        std::unordered_map<int64_t, int> scratch;
+        std::vector<int> freeScratch{ALLOC_SCRATCH_REGISTER_1, ALLOC_SCRATCH_REGISTER_0};
+        if (instr.mnemonic == MNEMONIC_RAW || instr.operands.size() > 3)
+            freeScratch.insert(freeScratch.begin(), ALLOC_SCRATCH_REGISTER_2);
+        for (int pass = 0; pass < 2; pass++) {
+            for (int o = 0; o < instr.operands.size(); o++) {
+                auto& operand = instr.operands[o];
+                if (operand.type != OPERAND_VIRTUAL || (pass == 0) != isUse(instr, o))
+                    continue;
+                const auto& interval = this->intervals[operand.value];
+                if (interval.physicalRegister >= 0) {
+                    operand = MachineOperand::reg(interval.physicalRegister);
+                    continue;
+                }
+                const auto slot = MachineOperand::memory(ASM_REGISTER_SP, spillBase + interval.spillSlot * 8);
+                int reg;
+                if (auto found = scratch.find(operand.value); found != scratch.end()) {
+                    reg = found->second;
+                } else if (pass == 1) {
+                    // Inputs are read before the result is written, so any scratch register works here
+                    reg = ALLOC_SCRATCH_REGISTER_0;
+                } else {
+                    if (freeScratch.empty())
+                        return "Too many spilled variables used by one instruction: \"" + instr.toString() + '\"';
+                    reg = freeScratch.back();
+                    freeScratch.pop_back();
+                    scratch[operand.value] = reg;
+                    loads.emplace_back(MNEMONIC_LDR, std::vector{MachineOperand::reg(reg), slot});
+                }
+                if (isDef(instr, o))
+                    stores.emplace_back(MNEMONIC_STR, std::vector{MachineOperand::reg(reg), slot});
+                operand = MachineOperand::reg(reg);
+            }
+        }
+        out.insert(out.end(), loads.begin(), loads.end());
+        out.push_back(std::move(instr));
+        out.insert(out.end(), stores.begin(), stores.end());
+        this->spillInstructionCount += static_cast<int>(loads.size() + stores.size());
+    }
+    setLines();
+
+    this->code = std::move(out);
+    return "";
+}
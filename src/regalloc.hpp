@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "instruction.hpp"
+
+struct LiveInterval {
+    int virtualRegister = 0;
+    int start = -1;
+    int end = -1;
+    // Physical register, or -1 if the interval lives in a stack slot
+    int physicalRegister = -1;
+    int spillSlot = -1;
+};
+
+class RegisterAllocator {
+public:
+    RegisterAllocator(std::vector<MachineInstruction>& code, int virtualRegisterCount, bool isProcedure);
+    // Assigns registers, inserts spill code and expands pseudo instructions
+    [[nodiscard]] std::string run();
+    [[nodiscard]] const LiveInterval& getInterval(int virtualRegister) const;
+    // Virtual registers living in stack slots, and the loads and stores added for them
+    [[nodiscard]] int getSpilledCount() const;
+    [[nodiscard]] int getSpillInstructionCount() const;
+    // Calls made, and registers saved around them in total
+    [[nodiscard]] int getCallCount() const;
+    [[nodiscard]] int getSavedRegisterCount() const;
+private:
+    std::vector<MachineInstruction>& code;
+    int virtualRegisterCount;
+    bool isProcedure;
+
+    std::vector<LiveInterval> intervals;
+    int spillSlots = 0;
+    // Virtual registers still needed after each call, keyed by the position of the call
+    std::unordered_map<int, std::vector<int>> liveAfterCall;
+    // Procedures that never call anything don't need to save the link register
+    bool isLeaf = true;
+    int spillInstructionCount = 0;
+    int callCount = 0;
+    int savedRegisterCount = 0;
+
+    void computeLiveIntervals();
+    void linearScan(const std::vector<int>& pool);
+    [[nodiscard]] std::vector<int> getCallerSavedRegisters(int pos) const;
+    [[nodiscard]] int getSaveAreaSize() const;
+    [[nodiscard]] std::string rewrite();
+};
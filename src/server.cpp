@@ -0,0 +1,179 @@
+#include "server.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "utilities.hpp"
+
+#if __has_include(<sys/un.h>)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define ARMCOMP_HAS_UNIX_SOCKETS
+#endif
+
+// Servers and clients from different builds may compile differently, so they refuse to talk to each other
+#define ARMCOMP_SERVER_PROTOCOL "armcomp-server 1 " ARMCOMP_VERSION
+
+#ifdef ARMCOMP_HAS_UNIX_SOCKETS
+
+// Writing to a client that has gone away is an error, not a reason to stop the server
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace {
+
+// A message is its size on its own line followed by its fields, written the same way strings are in the cache
+bool sendMessage(int socket, const std::vector<std::string>& fields) {
+    std::string payload;
+    writeStrings(payload, fields);
+    std::string message;
+    writeString(message, payload);
+    for (std::size_t sent = 0; sent < message.size();) {
+        const auto count = ::send(socket, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        sent += count;
+    }
+    return true;
+}
+
+bool receiveMessage(int socket, std::vector<std::string>& fields) {
+    std::string buffer;
+    char chunk[0x10000];
+    while (true) {
+        std::string_view in = buffer;
+        if (std::string payload; readString(in, payload)) {
+            std::string_view fieldsIn = payload;
+            return readStrings(fieldsIn, fields) && fieldsIn.empty();
+        }
+        const auto count = ::recv(socket, chunk, sizeof(chunk), 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        buffer.append(chunk, count);
+    }
+}
+
+bool parseInt(std::string_view value, int& number) {
+    const auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+    return ec == std::errc{} && ptr == value.data() + value.size();
+}
+
+// Fills in the address of the socket, returns false if the path doesn't fit
+bool getAddress(const std::string& socketPath, sockaddr_un& address) {
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        return false;
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    return true;
+}
+
+} // namespace
+
+#endif
+
+CompileServer::CompileServer(std::string socketPath_, Handler handler_)
+        : socketPath(std::move(socketPath_))
+        , handler(std::move(handler_)) {}
+
+std::string CompileServer::run() {
+#ifdef ARMCOMP_HAS_UNIX_SOCKETS
+    sockaddr_un address;
+    if (!getAddress(this->socketPath, address))
+        return "Socket path is too long: \"" + this->socketPath + '\"';
+    const int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0)
+        return "Could not create a socket: " + std::string{std::strerror(errno)};
+    // A server that was stopped leaves its socket behind
+    std::error_code error;
+    if (std::filesystem::is_socket(this->socketPath, error))
+        std::filesystem::remove(this->socketPath, error);
+    if (::bind(server, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(server, SOMAXCONN) != 0) {
+        const auto reason = std::string{std::strerror(errno)};
+        ::close(server);
+        return "Could not listen on \"" + this->socketPath + "\": " + reason;
+    }
+    while (true) {
+        const int client = ::accept(server, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        std::thread{[this, client] {
+            this->serveClient(client);
+            ::close(client);
+        }}.detach();
+    }
+#else
+    return "The compile server needs Unix domain sockets, which this platform doesn't have";
+#endif
+}
+
+void CompileServer::serveClient(int client) const {
+#ifdef ARMCOMP_HAS_UNIX_SOCKETS
+    CompileResponse response;
+    try {
+        std::vector<std::string> fields;
+        if (!receiveMessage(client, fields))
+            return;
+        CompileRequest request;
+        int target = 0;
+        if (fields.size() != 6 || fields[0] != ARMCOMP_SERVER_PROTOCOL || !parseInt(fields[3], request.options.optimizationLevel) || !parseInt(fields[4], target)) {
+            response.error = "The compile server is running a different version of armcomp";
+        } else {
+            request.path = std::move(fields[1]);
+            request.source = std::move(fields[2]);
+            request.options.target = static_cast<Target>(target);
+            request.options.sourceMap = fields[5] == "1";
+            this->handler(request, response);
+        }
+    } catch (const std::exception& exception) {
+        // Each client runs on a detached thread, anything escaping it would take the whole server down
+        response = {.error = "The compile server could not handle the request: " + std::string{exception.what()}};
+    }
+    // Nothing can be done if the client has already gone
+    (void) sendMessage(client, {std::move(response.error), std::move(response.log), std::move(response.assembly), std::move(response.sourceMap)});
+#endif
+}
+
+std::string requestCompile(const std::string& socketPath, const CompileRequest& request, CompileResponse& response) {
+#ifdef ARMCOMP_HAS_UNIX_SOCKETS
+    sockaddr_un address;
+    if (!getAddress(socketPath, address))
+        return "Socket path is too long: \"" + socketPath + '\"';
+    const int client = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client < 0)
+        return "Could not create a socket: " + std::string{std::strerror(errno)};
+    if (::connect(client, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        const auto reason = std::string{std::strerror(errno)};
+        ::close(client);
+        return "Could not connect to the compile server at \"" + socketPath + "\": " + reason;
+    }
+    std::vector<std::string> fields{
+        ARMCOMP_SERVER_PROTOCOL,
+        request.path,
+        request.source,
+        std::to_string(request.options.optimizationLevel),
+        std::to_string(request.options.target),
+        request.options.sourceMap ? "1" : "0",
+    };
+    const bool received = sendMessage(client, fields) && receiveMessage(client, fields) && fields.size() == 4;
+    ::close(client);
+    if (!received)
+        return "The compile server at \"" + socketPath + "\" closed the connection";
+    response = {std::move(fields[0]), std::move(fields[1]), std::move(fields[2]), std::move(fields[3])};
+    return "";
+#else
+    return "The compile server needs Unix domain sockets, which this platform doesn't have";
+#endif
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include "parser.hpp"
+
+// Where the server listens if --server or --client isn't given a path
+#define ARMCOMP_DEFAULT_SOCKET ".armcomp.sock"
+
+// A file to compile, sent by the client along with its contents so the server never reads the client's files
+struct CompileRequest {
+    std::string path;
+    std::string source;
+    // The cache is the server's own
+    ParserOptions options;
+};
+
+struct CompileResponse {
+    // Empty if the file compiled
+    std::string error;
+    // Everything that would have been logged compiling the file locally
+    std::string log;
+    std::string assembly;
+    // Empty unless the source map was asked for
+    std::string sourceMap;
+};
+
+// Compiles files for clients connecting to a Unix domain socket, each client is handled on its own thread
+class CompileServer {
+public:
+    using Handler = std::function<void(const CompileRequest&, CompileResponse&)>;
+
+    CompileServer(std::string socketPath, Handler handler);
+    // Only returns if the socket can't be opened
+    [[nodiscard]] std::string run();
+private:
+    std::string socketPath;
+    Handler handler;
+
+    void serveClient(int client) const;
+};
+
+// Has the server listening at socketPath compile a file, returns an error if it couldn't be reached
+[[nodiscard]] std::string requestCompile(const std::string& socketPath, const CompileRequest& request, CompileResponse& response);
@@ -0,0 +1,854 @@
+#include "simulator.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <random>
+
+// Matches the memory layout of ARMSim: | stack | static | heap |
+#define SIM_STACK_SIZE 4096
+#define SIM_HEAP_SIZE 0x4000
+#define SIM_SYSCALL_READ 63
+#define SIM_SYSCALL_WRITE 64
+#define SIM_SYSCALL_EXIT 93
+#define SIM_SYSCALL_BRK 214
+#define SIM_SYSCALL_GETRANDOM 278
+
+namespace {
+
+std::string_view trim(std::string_view str) {
+    while (!str.empty() && std::isspace(static_cast<unsigned char>(str.front())))
+        str.remove_prefix(1);
+    while (!str.empty() && std::isspace(static_cast<unsigned char>(str.back())))
+        str.remove_suffix(1);
+    return str;
+}
+
+// Lowercases, collapses whitespace, and removes the optional '#' and any spaces around commas
+std::string normalizeCodeLine(std::string_view line) {
+    std::string out;
+    out.reserve(line.size());
+    for (char c : line) {
+        if (c == '#')
+            continue;
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            if (!out.empty() && out.back() != ' ' && out.back() != ',')
+                out += ' ';
+            continue;
+        }
+        if (c == ',' && !out.empty() && out.back() == ' ')
+            out.pop_back();
+        out += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    return out;
+}
+
+bool isLabel(std::string_view line) {
+    std::size_t i = 0;
+    while (i < line.size() && line[i] == '.')
+        i++;
+    const std::size_t start = i;
+    while (i < line.size() && (std::isalnum(static_cast<unsigned char>(line[i])) || line[i] == '_'))
+        i++;
+    return i > start && i < line.size() && line[i] == ':';
+}
+
+bool parseRegister(std::string_view str, uint8_t& reg) {
+    if (str == "fp") {
+        reg = SIM_REGISTER_FP;
+    } else if (str == "lr") {
+        reg = SIM_REGISTER_LR;
+    } else if (str == "sp") {
+        reg = SIM_REGISTER_SP;
+    } else if (str == "xzr") {
+        reg = SIM_REGISTER_XZR;
+    } else {
+        if (str.size() < 2 || str.size() > 3 || str[0] != 'x')
+            return false;
+        int index = 0;
+        auto [ptr, ec] = std::from_chars(str.data() + 1, str.data() + str.size(), index);
+        if (ec != std::errc{} || ptr != str.data() + str.size() || index > SIM_REGISTER_LR)
+            return false;
+        reg = static_cast<uint8_t>(index);
+    }
+    return true;
+}
+
+bool parseImmediate(std::string_view str, int64_t& imm) {
+    bool negative = false;
+    if (str.starts_with('-')) {
+        negative = true;
+        str.remove_prefix(1);
+    }
+    int base = 10;
+    if (str.starts_with("0x")) {
+        base = 16;
+        str.remove_prefix(2);
+    }
+    if (str.empty())
+        return false;
+    uint64_t value = 0;
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value, base);
+    if (ec != std::errc{} || ptr != str.data() + str.size())
+        return false;
+    imm = static_cast<int64_t>(negative ? 0 - value : value);
+    return true;
+}
+
+// Parses "[rn]", "[rn,imm]", "[rn,rm]" and "[rn,imm]!"
+bool parseAddress(std::string_view str, uint8_t& base, int64_t& offset, uint8_t& offsetReg, bool& hasOffsetReg, bool& preIndex) {
+    preIndex = str.ends_with('!');
+    if (preIndex)
+        str.remove_suffix(1);
+    if (!str.starts_with('[') || !str.ends_with(']'))
+        return false;
+    str = str.substr(1, str.size() - 2);
+    offset = 0;
+    hasOffsetReg = false;
+    const auto comma = str.find(',');
+    if (comma == std::string_view::npos)
+        return !preIndex && parseRegister(str, base);
+    if (!parseRegister(str.substr(0, comma), base))
+        return false;
+    const auto second = str.substr(comma + 1);
+    if (parseImmediate(second, offset))
+        return true;
+    hasOffsetReg = !preIndex && parseRegister(second, offsetReg);
+    return hasOffsetReg;
+}
+
+std::vector<std::string_view> splitOperands(std::string_view str) {
+    std::vector<std::string_view> out;
+    int depth = 0;
+    std::size_t start = 0;
+    for (std::size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '[') {
+            depth++;
+        } else if (str[i] == ']') {
+            depth--;
+        } else if (str[i] == ',' && depth == 0) {
+            out.push_back(str.substr(start, i - start));
+            start = i + 1;
+        }
+    }
+    if (start < str.size())
+        out.push_back(str.substr(start));
+    return out;
+}
+
+inline int64_t wrapAdd(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+}
+
+inline int64_t wrapSub(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+}
+
+inline int64_t wrapMul(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b));
+}
+
+// ARMSim divides with Python's floor division, so round towards negative infinity
+inline int64_t floorDiv(int64_t a, int64_t b) {
+    if (b == -1)
+        return wrapSub(0, a);
+    int64_t quotient = a / b;
+    if (a % b != 0 && ((a < 0) != (b < 0)))
+        quotient--;
+    return quotient;
+}
+
+inline int64_t load64(const std::vector<uint8_t>& memory, int64_t addr) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | memory[addr + i];
+    return static_cast<int64_t>(value);
+}
+
+inline void store64(std::vector<uint8_t>& memory, int64_t addr, int64_t value) {
+    auto bits = static_cast<uint64_t>(value);
+    for (int i = 0; i < 8; i++, bits >>= 8)
+        memory[addr + i] = static_cast<uint8_t>(bits & 0xff);
+}
+
+// Finds the conditional branch for a condition code like "eq", returns OPCODE_INVALID if there isn't one
+Opcode getConditionalBranch(std::string_view condition) {
+    static constexpr std::pair<std::string_view, Opcode> branches[] = {
+        {"eq", OPCODE_B_EQ}, {"ne", OPCODE_B_NE}, {"lt", OPCODE_B_LT}, {"le", OPCODE_B_LE},
+        {"gt", OPCODE_B_GT}, {"ge", OPCODE_B_GE}, {"mi", OPCODE_B_MI}, {"pl", OPCODE_B_PL},
+    };
+    for (const auto& [name, opcode] : branches) {
+        if (name == condition)
+            return opcode;
+    }
+    return OPCODE_INVALID;
+}
+
+} // namespace
+
+Simulator::Simulator(std::ostream& output_, std::istream& input_)
+        : output(output_)
+        , input(input_) {}
+
+std::string Simulator::load(std::string_view assembly) {
+    this->code.clear();
+    this->sourceLines.clear();
+    this->assemblyLines.clear();
+    this->symbols.clear();
+    this->memory.assign(SIM_STACK_SIZE, 0);
+    std::fill(std::begin(this->registers), std::end(this->registers), 0);
+    this->registers[SIM_REGISTER_SP] = static_cast<int64_t>(this->memory.size()) - 1;
+    this->negativeFlag = false;
+    this->zeroFlag = false;
+    this->executedCount = 0;
+
+    std::unordered_map<std::string, int64_t> sizes;
+    std::unordered_map<std::string, uint32_t> labels;
+    // Branch targets and symbols are resolved once everything has been read
+    std::vector<std::pair<uint32_t, std::string>> unresolved;
+
+    bool inCode = false, inData = false, inComment = false;
+    std::string_view remaining = assembly;
+    uint32_t assemblyLine = 0;
+    while (!remaining.empty()) {
+        assemblyLine++;
+        const auto newline = remaining.find('\n');
+        auto line = trim(remaining.substr(0, newline));
+        remaining = newline == std::string_view::npos ? std::string_view{} : remaining.substr(newline + 1);
+
+        if (line.starts_with("/*") && line.find("*/") != std::string_view::npos)
+            continue;
+        if (line.starts_with("//"))
+            continue;
+        if (line.starts_with("/*")) {
+            inComment = true;
+            continue;
+        }
+        if (line.find("*/") != std::string_view::npos) {
+            inComment = false;
+            continue;
+        }
+        if (inComment || line.empty())
+            continue;
+        if (line.starts_with(".data") || line.starts_with(".bss")) {
+            inData = true;
+            inCode = false;
+            continue;
+        }
+        if (line == "main:" || line == "_start:") {
+            inCode = true;
+            inData = false;
+            continue;
+        }
+
+        if (inData) {
+            if (auto error = this->parseData(line, sizes); !error.empty())
+                return error;
+        } else if (inCode) {
+            auto normalized = normalizeCodeLine(line);
+            if (isLabel(normalized)) {
+                auto name = normalized.substr(0, normalized.find(':'));
+                if (labels.contains(name))
+                    return "You can't declare the same label more than once";
+                labels[name] = static_cast<uint32_t>(this->code.size());
+                continue;
+            }
+            Instruction instr;
+            std::string target;
+            instr.line = static_cast<uint32_t>(this->sourceLines.size());
+            if (!this->decode(normalized, instr, target))
+                instr.opcode = OPCODE_INVALID;
+            if (!target.empty())
+                unresolved.emplace_back(static_cast<uint32_t>(this->code.size()), std::move(target));
+            this->code.push_back(instr);
+            this->sourceLines.push_back(std::move(normalized));
+            this->assemblyLines.push_back(assemblyLine);
+        }
+    }
+
+    if (this->code.empty())
+        return "no code detected (remember to include a _start: or main: label)";
+
+    for (const auto& [index, name] : unresolved) {
+        auto& instr = this->code[index];
+        if (instr.opcode == OPCODE_LDR_SYMBOL) {
+            if (!this->symbols.contains(name))
+                return "Unknown symbol \"" + name + "\": " + this->sourceLines[instr.line];
+            instr.imm = this->symbols.at(name);
+        } else {
+            if (!labels.contains(name))
+                return this->sourceLines[instr.line] + " is calling a nonexistent label";
+            instr.imm = labels.at(name);
+        }
+    }
+
+    this->originalBreak = static_cast<int64_t>(this->memory.size());
+    this->programBreak = this->originalBreak;
+    return "";
+}
+
+std::string Simulator::parseData(std::string_view line, std::unordered_map<std::string, int64_t>& sizes) {
+    auto lower = [](std::string_view str) {
+        std::string out{trim(str)};
+        std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) { return std::tolower(c); });
+        return out;
+    };
+    const auto index = static_cast<int64_t>(this->memory.size());
+
+    if (const auto colon = line.find(':'); colon != std::string_view::npos) {
+        auto name = lower(line.substr(0, colon));
+        auto rest = trim(line.substr(colon + 1));
+        if (rest.starts_with(".asciz")) {
+            const auto open = rest.find('\"'), close = rest.rfind('\"');
+            if (open == std::string_view::npos || open == close)
+                return "Invalid string literal: " + std::string{line};
+            std::string str;
+            const auto literal = rest.substr(open + 1, close - open - 1);
+            for (std::size_t i = 0; i < literal.size(); i++) {
+                if (literal[i] == '\\' && i + 1 < literal.size()) {
+                    switch (literal[i + 1]) {
+                        case 'n': str += '\n'; i++; continue;
+                        case 't': str += '\t'; i++; continue;
+                        case 'r': str += '\r'; i++; continue;
+                        default: break;
+                    }
+                }
+                str += literal[i];
+            }
+            this->memory.insert(this->memory.end(), str.begin(), str.end());
+            sizes[name] = static_cast<int64_t>(str.size());
+            this->symbols[name] = index;
+        } else if (rest.starts_with(".space")) {
+            auto sizeStr = lower(rest.substr(6));
+            int64_t size = 0;
+            if (this->symbols.contains(sizeStr))
+                size = this->symbols.at(sizeStr);
+            else if (!parseImmediate(sizeStr, size) || size < 0)
+                return "Invalid .space size: " + std::string{line};
+            this->memory.resize(this->memory.size() + size, 0);
+            sizes[name] = size;
+            this->symbols[name] = index;
+        } else if (rest.starts_with(".8byte")) {
+            auto numbers = lower(rest.substr(6));
+            int64_t count = 0;
+            for (auto number : splitOperands(numbers)) {
+                int64_t value = 0;
+                if (!parseImmediate(trim(number), value))
+                    return "Invalid .8byte value: " + std::string{line};
+                this->memory.resize(this->memory.size() + 8);
+                store64(this->memory, static_cast<int64_t>(this->memory.size()) - 8, value);
+                count++;
+            }
+            sizes[name] = count * 8;
+            this->symbols[name] = index;
+        }
+    } else if (const auto equals = line.find('='); equals != std::string_view::npos) {
+        auto name = lower(line.substr(0, equals));
+        auto value = lower(line.substr(equals + 1));
+        value.erase(std::remove(value.begin(), value.end(), ' '), value.end());
+        if (value.starts_with(".-")) {
+            // len = .-str idiom
+            const auto target = value.substr(2);
+            if (!sizes.contains(target))
+                return "Can't find length of undeclared variable " + target;
+            this->symbols[name] = sizes.at(target);
+        } else if (this->symbols.contains(value)) {
+            this->symbols[name] = this->symbols.at(value);
+        } else {
+            int64_t imm = 0;
+            if (!parseImmediate(value, imm))
+                return "Invalid constant: " + std::string{line};
+            this->symbols[name] = imm;
+        }
+    }
+    return "";
+}
+
+bool Simulator::decode(std::string_view line, Instruction& instr, std::string& label) const {
+    const auto space = line.find(' ');
+    const auto mnemonic = line.substr(0, space);
+    const auto operands = splitOperands(space == std::string_view::npos ? std::string_view{} : line.substr(space + 1));
+
+    auto reg = [&operands](std::size_t i, uint8_t& out) {
+        return i < operands.size() && parseRegister(operands[i], out);
+    };
+    auto imm = [&operands](std::size_t i, int64_t& out) {
+        return i < operands.size() && parseImmediate(operands[i], out);
+    };
+
+    // Strip the optional flag-setting suffix from data processing instructions
+    auto base = mnemonic;
+    if (base.size() == 4 && base.ends_with('s') && (base.starts_with("add") || base.starts_with("sub") || base.starts_with("and") || base.starts_with("orr") || base.starts_with("eor"))) {
+        base.remove_suffix(1);
+        instr.setFlags = true;
+    }
+
+    if (mnemonic == "ldp" || mnemonic == "stp") {
+        const bool isLoad = mnemonic == "ldp";
+        uint8_t offsetReg;
+        bool hasOffsetReg, preIndex;
+        if ((operands.size() != 3 && operands.size() != 4) || !reg(0, instr.rd) || !reg(1, instr.ra) || !parseAddress(operands[2], instr.rn, instr.imm, offsetReg, hasOffsetReg, preIndex) || hasOffsetReg)
+            return false;
+        if (operands.size() == 4) {
+            if (preIndex || instr.imm != 0 || !imm(3, instr.imm))
+                return false;
+            instr.opcode = isLoad ? OPCODE_LDP_POST : OPCODE_STP_POST;
+        } else {
+            instr.opcode = preIndex ? (isLoad ? OPCODE_LDP_PRE : OPCODE_STP_PRE) : (isLoad ? OPCODE_LDP : OPCODE_STP);
+        }
+    } else if (mnemonic == "ldr" || mnemonic == "str") {
+        const bool isLoad = mnemonic == "ldr";
+        if (!reg(0, instr.rd))
+            return false;
+        if (isLoad && operands.size() == 2 && operands[1].starts_with('=')) {
+            instr.opcode = OPCODE_LDR_SYMBOL;
+            label = operands[1].substr(1);
+            return true;
+        }
+        bool hasOffsetReg, preIndex;
+        if ((operands.size() != 2 && operands.size() != 3) || !parseAddress(operands[1], instr.rn, instr.imm, instr.rm, hasOffsetReg, preIndex))
+            return false;
+        if (operands.size() == 3) {
+            if (preIndex || hasOffsetReg || instr.imm != 0 || !imm(2, instr.imm))
+                return false;
+            instr.opcode = isLoad ? OPCODE_LDR_POST : OPCODE_STR_POST;
+        } else if (hasOffsetReg) {
+            instr.opcode = isLoad ? OPCODE_LDR_REG : OPCODE_STR_REG;
+        } else {
+            instr.opcode = preIndex ? (isLoad ? OPCODE_LDR_PRE : OPCODE_STR_PRE) : (isLoad ? OPCODE_LDR : OPCODE_STR);
+        }
+    } else if (mnemonic == "mov") {
+        if (operands.size() != 2 || !reg(0, instr.rd))
+            return false;
+        if (imm(1, instr.imm))
+            instr.opcode = OPCODE_MOV_IMM;
+        else if (reg(1, instr.rn))
+            instr.opcode = OPCODE_MOV_REG;
+        else
+            return false;
+    } else if (mnemonic == "asr" || mnemonic == "lsl") {
+        if (operands.size() != 3 || !reg(0, instr.rd) || !reg(1, instr.rn) || !imm(2, instr.imm))
+            return false;
+        instr.opcode = mnemonic == "asr" ? OPCODE_ASR : OPCODE_LSL;
+    } else if (base == "add" || base == "sub" || base == "and" || base == "orr" || base == "eor") {
+        if (operands.size() != 3 || !reg(0, instr.rd) || !reg(1, instr.rn))
+            return false;
+        const bool isImm = imm(2, instr.imm);
+        if (!isImm && !reg(2, instr.rm))
+            return false;
+        if (base == "add")
+            instr.opcode = isImm ? OPCODE_ADD_IMM : OPCODE_ADD_REG;
+        else if (base == "sub")
+            instr.opcode = isImm ? OPCODE_SUB_IMM : OPCODE_SUB_REG;
+        else if (base == "and")
+            instr.opcode = isImm ? OPCODE_AND_IMM : OPCODE_AND_REG;
+        else if (base == "orr")
+            instr.opcode = isImm ? OPCODE_ORR_IMM : OPCODE_ORR_REG;
+        else
+            instr.opcode = isImm ? OPCODE_EOR_IMM : OPCODE_EOR_REG;
+    } else if (mnemonic == "mul" || mnemonic == "sdiv" || mnemonic == "udiv") {
+        if (operands.size() != 3 || !reg(0, instr.rd) || !reg(1, instr.rn) || !reg(2, instr.rm))
+            return false;
+        // ARMSim treats signed and unsigned division the same
+        instr.opcode = mnemonic == "mul" ? OPCODE_MUL : OPCODE_SDIV;
+    } else if (mnemonic == "msub" || mnemonic == "madd") {
+        if (operands.size() != 4 || !reg(0, instr.rd) || !reg(1, instr.rn) || !reg(2, instr.rm) || !reg(3, instr.ra))
+            return false;
+        instr.opcode = mnemonic == "msub" ? OPCODE_MSUB : OPCODE_MADD;
+    } else if (mnemonic == "cmp") {
+        if (operands.size() != 2 || !reg(0, instr.rn))
+            return false;
+        if (imm(1, instr.imm))
+            instr.opcode = OPCODE_CMP_IMM;
+        else if (reg(1, instr.rm) && instr.rm != SIM_REGISTER_SP)
+            instr.opcode = OPCODE_CMP_REG;
+        else
+            return false;
+    } else if (mnemonic == "csel") {
+        if (operands.size() != 4 || !reg(0, instr.rd) || !reg(1, instr.rn) || !reg(2, instr.rm))
+            return false;
+        instr.imm = getConditionalBranch(operands[3]);
+        if (instr.imm == OPCODE_INVALID)
+            return false;
+        instr.opcode = OPCODE_CSEL;
+    } else if (mnemonic == "cbz" || mnemonic == "cbnz") {
+        if (operands.size() != 2 || !reg(0, instr.rn))
+            return false;
+        instr.opcode = mnemonic == "cbz" ? OPCODE_CBZ : OPCODE_CBNZ;
+        label = operands[1];
+    } else if (mnemonic == "ret") {
+        if (!operands.empty())
+            return false;
+        instr.opcode = OPCODE_RET;
+    } else if (mnemonic == "svc") {
+        int64_t value;
+        if (operands.size() != 1 || !imm(0, value) || value != 0)
+            return false;
+        instr.opcode = OPCODE_SVC;
+    } else if (mnemonic.starts_with('b')) {
+        if (operands.size() != 1)
+            return false;
+        auto condition = mnemonic.substr(1);
+        if (condition.starts_with('.'))
+            condition.remove_prefix(1);
+        if (condition.empty())
+            instr.opcode = OPCODE_B;
+        else if (mnemonic == "bl")
+            instr.opcode = OPCODE_BL;
+        else if ((instr.opcode = getConditionalBranch(condition)) == OPCODE_INVALID)
+            return false;
+        label = operands[0];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string Simulator::run() {
+    auto& reg = this->registers;
+    auto& mem = this->memory;
+    const auto codeSize = static_cast<int64_t>(this->code.size());
+    const Instruction* const code = this->code.data();
+    this->profile.assign(this->profiling ? this->code.size() : 0, 0);
+
+    auto outOfBounds = [this](const Instruction& instr) {
+        return "out of bounds memory access: " + this->sourceLines[instr.line];
+    };
+
+    int64_t pc = 0;
+    while (pc < codeSize) {
+        const int64_t sp = reg[SIM_REGISTER_SP];
+        if (sp < 0)
+            return "stack overflow";
+        if (sp > SIM_STACK_SIZE)
+            return "stack underflow (make sure to allocate space)";
+        if ((sp + 1) % 16 != 0)
+            return "Alignment error: sp must be a multiple of 16";
+
+        const Instruction& instr = code[pc++];
+        if (++this->executedCount > this->instructionLimit && this->instructionLimit > 0)
+            return "instruction limit of " + std::to_string(this->instructionLimit) + " exceeded";
+        if (this->profiling)
+            this->profile[pc - 1]++;
+        const auto memSize = static_cast<int64_t>(mem.size());
+        switch (instr.opcode) {
+            case OPCODE_LDP:
+            case OPCODE_LDP_PRE:
+            case OPCODE_LDP_POST:
+            case OPCODE_STP:
+            case OPCODE_STP_PRE:
+            case OPCODE_STP_POST: {
+                int64_t addr = reg[instr.rn];
+                if (instr.opcode == OPCODE_LDP || instr.opcode == OPCODE_STP)
+                    addr += instr.imm;
+                else if (instr.opcode == OPCODE_LDP_PRE || instr.opcode == OPCODE_STP_PRE)
+                    addr = reg[instr.rn] += instr.imm;
+                if (addr < 0 || addr < reg[SIM_REGISTER_SP] || addr > memSize - 16)
+                    return outOfBounds(instr);
+                if (instr.opcode == OPCODE_LDP || instr.opcode == OPCODE_LDP_PRE || instr.opcode == OPCODE_LDP_POST) {
+                    reg[instr.rd] = load64(mem, addr);
+                    reg[instr.ra] = load64(mem, addr + 8);
+                } else {
+                    store64(mem, addr, reg[instr.rd]);
+                    store64(mem, addr + 8, reg[instr.ra]);
+                }
+                if (instr.opcode == OPCODE_LDP_POST || instr.opcode == OPCODE_STP_POST)
+                    reg[instr.rn] += instr.imm;
+                break;
+            }
+            case OPCODE_LDR_SYMBOL:
+                reg[instr.rd] = instr.imm;
+                break;
+            case OPCODE_LDR:
+            case OPCODE_LDR_REG:
+            case OPCODE_LDR_PRE:
+            case OPCODE_LDR_POST: {
+                int64_t addr = reg[instr.rn];
+                if (instr.opcode == OPCODE_LDR)
+                    addr += instr.imm;
+                else if (instr.opcode == OPCODE_LDR_REG)
+                    addr += reg[instr.rm];
+                else if (instr.opcode == OPCODE_LDR_PRE)
+                    addr = reg[instr.rn] += instr.imm;
+                if (addr < 0 || addr < reg[SIM_REGISTER_SP] || addr > memSize - 8)
+                    return outOfBounds(instr);
+                reg[instr.rd] = load64(mem, addr);
+                if (instr.opcode == OPCODE_LDR_POST)
+                    reg[instr.rn] += instr.imm;
+                break;
+            }
+            case OPCODE_STR:
+            case OPCODE_STR_REG:
+            case OPCODE_STR_PRE:
+            case OPCODE_STR_POST: {
+                int64_t addr = reg[instr.rn];
+                if (instr.opcode == OPCODE_STR)
+                    addr += instr.imm;
+                else if (instr.opcode == OPCODE_STR_REG)
+                    addr += reg[instr.rm];
+                else if (instr.opcode == OPCODE_STR_PRE)
+                    addr = reg[instr.rn] += instr.imm;
+                if (addr < 0 || addr < reg[SIM_REGISTER_SP] || addr > memSize - 8)
+                    return outOfBounds(instr);
+                store64(mem, addr, reg[instr.rd]);
+                if (instr.opcode == OPCODE_STR_POST)
+                    reg[instr.rn] += instr.imm;
+                break;
+            }
+            case OPCODE_MOV_IMM:
+                reg[instr.rd] = instr.imm;
+                break;
+            case OPCODE_MOV_REG:
+                reg[instr.rd] = reg[instr.rn];
+                break;
+            case OPCODE_ASR:
+                reg[instr.rd] = reg[instr.rn] >> std::min<int64_t>(instr.imm, 63);
+                break;
+            case OPCODE_LSL:
+                reg[instr.rd] = instr.imm > 63 ? 0 : static_cast<int64_t>(static_cast<uint64_t>(reg[instr.rn]) << instr.imm);
+                break;
+            case OPCODE_ADD_IMM:
+            case OPCODE_ADD_REG:
+            case OPCODE_SUB_IMM:
+            case OPCODE_SUB_REG:
+            case OPCODE_AND_IMM:
+            case OPCODE_AND_REG:
+            case OPCODE_ORR_IMM:
+            case OPCODE_ORR_REG:
+            case OPCODE_EOR_IMM:
+            case OPCODE_EOR_REG: {
+                const int64_t lhs = reg[instr.rn];
+                int64_t rhs = instr.imm, result;
+                switch (instr.opcode) {
+                    case OPCODE_ADD_REG: rhs = reg[instr.rm]; [[fallthrough]];
+                    case OPCODE_ADD_IMM: result = wrapAdd(lhs, rhs); break;
+                    case OPCODE_SUB_REG: rhs = reg[instr.rm]; [[fallthrough]];
+                    case OPCODE_SUB_IMM: result = wrapSub(lhs, rhs); break;
+                    case OPCODE_AND_REG: rhs = reg[instr.rm]; [[fallthrough]];
+                    case OPCODE_AND_IMM: result = lhs & rhs; break;
+                    case OPCODE_ORR_REG: rhs = reg[instr.rm]; [[fallthrough]];
+                    case OPCODE_ORR_IMM: result = lhs | rhs; break;
+                    case OPCODE_EOR_REG: rhs = reg[instr.rm]; [[fallthrough]];
+                    default: result = lhs ^ rhs; break;
+                }
+                reg[instr.rd] = result;
+                if (instr.setFlags) {
+                    this->negativeFlag = result < 0;
+                    this->zeroFlag = result == 0;
+                }
+                break;
+            }
+            case OPCODE_MUL:
+                reg[instr.rd] = wrapMul(reg[instr.rn], reg[instr.rm]);
+                break;
+            case OPCODE_SDIV:
+                if (reg[instr.rm] == 0)
+                    return "division by zero: " + this->sourceLines[instr.line];
+                reg[instr.rd] = floorDiv(reg[instr.rn], reg[instr.rm]);
+                break;
+            case OPCODE_MSUB:
+                reg[instr.rd] = wrapSub(reg[instr.ra], wrapMul(reg[instr.rn], reg[instr.rm]));
+                break;
+            case OPCODE_MADD:
+                reg[instr.rd] = wrapAdd(reg[instr.ra], wrapMul(reg[instr.rn], reg[instr.rm]));
+                break;
+            case OPCODE_CMP_IMM:
+                this->zeroFlag = reg[instr.rn] == instr.imm;
+                this->negativeFlag = reg[instr.rn] < instr.imm;
+                break;
+            case OPCODE_CMP_REG:
+                this->zeroFlag = reg[instr.rn] == reg[instr.rm];
+                this->negativeFlag = reg[instr.rn] < reg[instr.rm];
+                break;
+            case OPCODE_CSEL:
+                reg[instr.rd] = this->testCondition(static_cast<Opcode>(instr.imm)) ? reg[instr.rn] : reg[instr.rm];
+                break;
+            case OPCODE_CBZ:
+                if (reg[instr.rn] == 0)
+                    pc = instr.imm;
+                break;
+            case OPCODE_CBNZ:
+                if (reg[instr.rn] != 0)
+                    pc = instr.imm;
+                break;
+            case OPCODE_B:
+                pc = instr.imm;
+                break;
+            case OPCODE_B_EQ:
+                if (this->zeroFlag)
+                    pc = instr.imm;
+                break;
+            case OPCODE_B_NE:
+                if (!this->zeroFlag)
+                    pc = instr.imm;
+                break;
+            case OPCODE_B_LT:
+            case OPCODE_B_MI:
+                if (this->negativeFlag)
+                    pc = instr.imm;
+                break;
+            case OPCODE_B_LE:
+                if (this->negativeFlag || this->zeroFlag)
+                    pc = instr.imm;
+                break;
+            case OPCODE_B_GT:
+                if (!this->zeroFlag && !this->negativeFlag)
+                    pc = instr.imm;
+                break;
+            case OPCODE_B_GE:
+                if (!this->negativeFlag)
+                    pc = instr.imm;
+                break;
+            case OPCODE_B_PL:
+                if (!this->negativeFlag || this->zeroFlag)
+                    pc = instr.imm;
+                break;
+            case OPCODE_BL:
+                reg[SIM_REGISTER_LR] = pc;
+                pc = instr.imm;
+                break;
+            case OPCODE_RET:
+                if (reg[SIM_REGISTER_LR] < 0 || reg[SIM_REGISTER_LR] > codeSize)
+                    return "ret: address in LR (" + std::to_string(reg[SIM_REGISTER_LR]) + ") out of range";
+                pc = reg[SIM_REGISTER_LR];
+                break;
+            case OPCODE_SVC: {
+                bool exited = false;
+                if (auto error = this->syscall(exited); !error.empty())
+                    return error;
+                if (exited)
+                    pc = codeSize;
+                break;
+            }
+            case OPCODE_INVALID:
+                return "Unsupported instruction or syntax error: " + this->sourceLines[instr.line];
+        }
+        reg[SIM_REGISTER_XZR] = 0;
+    }
+    return "";
+}
+
+std::string Simulator::syscall(bool& exited) {
+    auto& reg = this->registers;
+    auto& mem = this->memory;
+    switch (reg[8]) {
+        case SIM_SYSCALL_EXIT:
+            exited = true;
+            break;
+        case SIM_SYSCALL_WRITE: {
+            if (reg[0] != 1)
+                return "Can only write to stdout! (x0 must contain #1)";
+            const int64_t addr = reg[1], length = reg[2];
+            if (addr < 0 || length < 0 || addr + length > static_cast<int64_t>(mem.size()))
+                return "out of bounds memory access: write syscall";
+            this->output.write(reinterpret_cast<const char*>(mem.data() + addr), length);
+            break;
+        }
+        case SIM_SYSCALL_READ: {
+            const int64_t addr = reg[1], length = reg[2];
+            std::string line;
+            std::getline(this->input, line);
+            line += '\n';
+            line.resize(std::min<std::size_t>(line.size(), std::max<int64_t>(length, 0)));
+            if (addr < 0 || addr + static_cast<int64_t>(line.size()) > static_cast<int64_t>(mem.size()))
+                return "out of bounds memory access: read syscall";
+            std::memcpy(mem.data() + addr, line.data(), line.size());
+            reg[0] = static_cast<int64_t>(line.size());
+            break;
+        }
+        case SIM_SYSCALL_BRK: {
+            const int64_t newBreak = reg[0];
+            if (newBreak < this->originalBreak) {
+                reg[0] = this->programBreak;
+            } else if (newBreak == this->originalBreak) {
+                this->programBreak = newBreak;
+                mem.resize(this->originalBreak);
+            } else {
+                // Round up to the nearest page boundary of 4K bytes
+                const int64_t breakSize = newBreak - this->originalBreak;
+                const int64_t page = (breakSize + 0x1000) - breakSize % 0x1000;
+                if (page > SIM_HEAP_SIZE)
+                    return "break size of " + std::to_string(breakSize) + " too large";
+                mem.resize(this->originalBreak + page, 0);
+                this->programBreak = newBreak;
+            }
+            break;
+        }
+        case SIM_SYSCALL_GETRANDOM: {
+            const int64_t addr = reg[0], quantity = reg[1];
+            if (addr < 0 || quantity < 0 || addr + quantity > static_cast<int64_t>(mem.size()))
+                return "out of bounds memory access: getrandom syscall";
+            std::random_device device;
+            for (int64_t i = 0; i < quantity; i++)
+                mem[addr + i] = static_cast<uint8_t>(device() & 0xff);
+            reg[0] = quantity;
+            break;
+        }
+        default:
+            return "Unsupported system call: " + std::to_string(reg[8]);
+    }
+    return "";
+}
+
+bool Simulator::testCondition(Opcode branch) const {
+    switch (branch) {
+        case OPCODE_B_EQ:
+            return this->zeroFlag;
+        case OPCODE_B_NE:
+            return !this->zeroFlag;
+        case OPCODE_B_LT:
+        case OPCODE_B_MI:
+            return this->negativeFlag;
+        case OPCODE_B_LE:
+            return this->negativeFlag || this->zeroFlag;
+        case OPCODE_B_GT:
+            return !this->zeroFlag && !this->negativeFlag;
+        case OPCODE_B_GE:
+            return !this->negativeFlag;
+        case OPCODE_B_PL:
+            return !this->negativeFlag || this->zeroFlag;
+        default:
+            return true;
+    }
+}
+
+int64_t Simulator::getRegister(int index) const {
+    return this->registers[index];
+}
+
+int Simulator::getExitCode() const {
+    // The process exit status only keeps the low byte
+    return static_cast<int>(this->registers[0] & 0xff);
+}
+
+uint64_t Simulator::getExecutedCount() const {
+    return this->executedCount;
+}
+
+void Simulator::setProfiling(bool enabled) {
+    this->profiling = enabled;
+}
+
+void Simulator::setInstructionLimit(uint64_t limit) {
+    this->instructionLimit = limit;
+}
+
+std::vector<std::pair<uint32_t, uint64_t>> Simulator::getProfile() const {
+    std::vector<std::pair<uint32_t, uint64_t>> out;
+    for (std::size_t i = 0; i < this->profile.size(); i++) {
+        if (this->profile[i] > 0)
+            out.emplace_back(this->assemblyLines[i], this->profile[i]);
+    }
+    return out;
+}
+
+std::string Simulator::getRegisterDump() const {
+    std::string out;
+    for (int i = 10; i <= 28; i++) {
+        if (this->registers[i] == 0)
+            continue;
+        out += 'X' + std::to_string(i) + ": " + std::to_string(this->registers[i]) + '\n';
+    }
+    return out;
+}
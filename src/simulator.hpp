@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Register indices used by decoded instructions
+#define SIM_REGISTER_FP  29
+#define SIM_REGISTER_LR  30
+#define SIM_REGISTER_SP  31
+#define SIM_REGISTER_XZR 32
+#define SIM_REGISTER_COUNT 33
+
+enum Opcode : uint8_t {
+    OPCODE_INVALID = 0,
+    OPCODE_LDP,
+    OPCODE_LDP_PRE,
+    OPCODE_LDP_POST,
+    OPCODE_STP,
+    OPCODE_STP_PRE,
+    OPCODE_STP_POST,
+    OPCODE_LDR_SYMBOL,
+    OPCODE_LDR,
+    OPCODE_LDR_REG,
+    OPCODE_LDR_PRE,
+    OPCODE_LDR_POST,
+    OPCODE_STR,
+    OPCODE_STR_REG,
+    OPCODE_STR_PRE,
+    OPCODE_STR_POST,
+    OPCODE_MOV_IMM,
+    OPCODE_MOV_REG,
+    OPCODE_ASR,
+    OPCODE_LSL,
+    OPCODE_ADD_IMM,
+    OPCODE_ADD_REG,
+    OPCODE_SUB_IMM,
+    OPCODE_SUB_REG,
+    OPCODE_MUL,
+    OPCODE_SDIV,
+    OPCODE_MSUB,
+    OPCODE_MADD,
+    OPCODE_AND_IMM,
+    OPCODE_AND_REG,
+    OPCODE_ORR_IMM,
+    OPCODE_ORR_REG,
+    OPCODE_EOR_IMM,
+    OPCODE_EOR_REG,
+    OPCODE_CMP_IMM,
+    OPCODE_CMP_REG,
+    // imm holds the conditional branch whose condition picks rn over rm
+    OPCODE_CSEL,
+    OPCODE_CBZ,
+    OPCODE_CBNZ,
+    OPCODE_B,
+    OPCODE_B_EQ,
+    OPCODE_B_NE,
+    OPCODE_B_LT,
+    OPCODE_B_LE,
+    OPCODE_B_GT,
+    OPCODE_B_GE,
+    OPCODE_B_MI,
+    OPCODE_B_PL,
+    OPCODE_BL,
+    OPCODE_RET,
+    OPCODE_SVC,
+};
+
+struct Instruction {
+    Opcode opcode = OPCODE_INVALID;
+    // Set for the flag-setting variants (adds, subs, ands...)
+    bool setFlags = false;
+    uint8_t rd = SIM_REGISTER_XZR;
+    uint8_t rn = SIM_REGISTER_XZR;
+    uint8_t rm = SIM_REGISTER_XZR;
+    uint8_t ra = SIM_REGISTER_XZR;
+    int64_t imm = 0;
+    // Index into the source lines, used for error messages
+    uint32_t line = 0;
+};
+
+class Simulator {
+public:
+    explicit Simulator(std::ostream& output = std::cout, std::istream& input = std::cin);
+    [[nodiscard]] std::string load(std::string_view assembly);
+    [[nodiscard]] std::string run();
+    [[nodiscard]] int64_t getRegister(int index) const;
+    [[nodiscard]] int getExitCode() const;
+    // Number of instructions run so far
+    [[nodiscard]] uint64_t getExecutedCount() const;
+    // Counts how many times each instruction runs, must be set before run
+    void setProfiling(bool enabled);
+    // run fails once more than this many instructions have run, 0 means no limit
+    void setInstructionLimit(uint64_t limit);
+    // Pairs of assembly line (starting at 1) and how many times the instruction on it ran, skips ones that never did
+    [[nodiscard]] std::vector<std::pair<uint32_t, uint64_t>> getProfile() const;
+    [[nodiscard]] std::string getRegisterDump() const;
+private:
+    std::ostream& output;
+    std::istream& input;
+
+    std::vector<Instruction> code;
+    std::vector<std::string> sourceLines;
+    // Line in the assembly text of each instruction
+    std::vector<uint32_t> assemblyLines;
+    std::vector<uint64_t> profile;
+    bool profiling = false;
+    uint64_t instructionLimit = 0;
+    std::unordered_map<std::string, int64_t> symbols;
+    std::vector<uint8_t> memory;
+    int64_t registers[SIM_REGISTER_COUNT]{};
+    int64_t originalBreak = 0;
+    int64_t programBreak = 0;
+    bool negativeFlag = false;
+    bool zeroFlag = false;
+    uint64_t executedCount = 0;
+
+    [[nodiscard]] std::string parseData(std::string_view line, std::unordered_map<std::string, int64_t>& sizes);
+    [[nodiscard]] bool decode(std::string_view line, Instruction& instr, std::string& label) const;
+    [[nodiscard]] std::string syscall(bool& exited);
+    // True if a conditional branch with this opcode would be taken
+    [[nodiscard]] bool testCondition(Opcode branch) const;
+};
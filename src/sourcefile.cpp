@@ -0,0 +1,77 @@
+#include "sourcefile.hpp"
+
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ARMCOMP_HAS_MMAP
+#endif
+
+std::string SourcePosition::toString() const {
+    return std::string{this->file} + ':' + std::to_string(this->line) + ':' + std::to_string(this->column);
+}
+
+SourceFile::SourceFile(const std::string& path_)
+        : path(path_) {
+#ifdef ARMCOMP_HAS_MMAP
+    if (const int fd = ::open(this->path.c_str(), O_RDONLY); fd >= 0) {
+        struct stat info{};
+        if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+            this->open = true;
+            this->size = static_cast<std::size_t>(info.st_size);
+            // Empty files can't be mapped, but there is nothing to read anyway
+            if (this->size > 0) {
+                if (void* address = ::mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0); address != MAP_FAILED) {
+                    this->data = static_cast<const char*>(address);
+                    this->mapped = true;
+                } else {
+                    this->open = false;
+                }
+            }
+        }
+        ::close(fd);
+        if (this->open)
+            return;
+    }
+#endif
+    // Fall back to reading the whole file at once
+    std::ifstream file{this->path, std::ios::in | std::ios::binary};
+    if (!file.is_open())
+        return;
+    this->buffer.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+    this->open = true;
+    this->data = this->buffer.data();
+    this->size = this->buffer.size();
+}
+
+SourceFile::SourceFile(std::string path_, std::string contents)
+        : path(std::move(path_))
+        , open(true)
+        , buffer(std::move(contents)) {
+    this->data = this->buffer.data();
+    this->size = this->buffer.size();
+}
+
+SourceFile::~SourceFile() {
+#ifdef ARMCOMP_HAS_MMAP
+    if (this->mapped)
+        ::munmap(const_cast<char*>(this->data), this->size);
+#endif
+}
+
+bool SourceFile::isOpen() const {
+    return this->open;
+}
+
+const std::string& SourceFile::getPath() const {
+    return this->path;
+}
+
+std::string_view SourceFile::getContents() const {
+    return {this->data, this->size};
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Where a line of source code came from, lines and columns start at 1
+struct SourcePosition {
+    std::string_view file;
+    uint32_t line = 0;
+    uint32_t column = 0;
+
+    [[nodiscard]] std::string toString() const;
+};
+
+// A preprocessed line of source code, its tokens are stored contiguously with the tokens of every other line
+struct SourceLine {
+    std::string_view text;
+    uint32_t firstToken = 0;
+    uint32_t tokenCount = 0;
+    SourcePosition position;
+};
+
+// Maps a file into memory so it can be read through views without copying it
+class SourceFile {
+public:
+    explicit SourceFile(const std::string& path);
+    // Source that is already in memory, such as a file sent to the compile server. The path is only used in errors
+    SourceFile(std::string path, std::string contents);
+    ~SourceFile();
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    [[nodiscard]] bool isOpen() const;
+    [[nodiscard]] const std::string& getPath() const;
+    // Valid as long as this object is
+    [[nodiscard]] std::string_view getContents() const;
+private:
+    std::string path;
+    bool open = false;
+    const char* data = nullptr;
+    std::size_t size = 0;
+    bool mapped = false;
+    // Holds the contents when the file couldn't be mapped or was never on disk
+    std::string buffer;
+};
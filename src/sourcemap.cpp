@@ -0,0 +1,39 @@
+#include "sourcemap.hpp"
+
+#include <algorithm>
+
+void SourceMap::addFunction(std::string name) {
+    this->functions.push_back(std::move(name));
+}
+
+void SourceMap::add(uint32_t assemblyLine, SourcePosition position) {
+    this->entries.push_back({assemblyLine, position, static_cast<int>(this->functions.size()) - 1});
+}
+
+const SourceMap::Entry* SourceMap::find(uint32_t assemblyLine) const {
+    const auto entry = std::lower_bound(this->entries.begin(), this->entries.end(), assemblyLine, [](const Entry& entry, uint32_t line) {
+        return entry.assemblyLine < line;
+    });
+    if (entry == this->entries.end() || entry->assemblyLine != assemblyLine)
+        return nullptr;
+    return &*entry;
+}
+
+std::string_view SourceMap::getFunctionName(int function) const {
+    return this->functions[function];
+}
+
+std::string SourceMap::toString() const {
+    std::string out;
+    for (const auto& entry : this->entries) {
+        out += std::to_string(entry.assemblyLine);
+        out += ' ';
+        out += entry.position.file;
+        out += ':';
+        out += std::to_string(entry.position.line);
+        out += ' ';
+        out += this->functions[entry.function];
+        out += '\n';
+    }
+    return out;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sourcefile.hpp"
+
+// Links lines of generated assembly back to the source lines they were compiled from
+class SourceMap {
+public:
+    struct Entry {
+        // Lines of the assembly start at 1, like source lines
+        uint32_t assemblyLine = 0;
+        SourcePosition position;
+        // Index into the function names
+        int function = 0;
+    };
+
+    // Entries must be added in assembly order, later functions are added after earlier ones
+    void addFunction(std::string name);
+    void add(uint32_t assemblyLine, SourcePosition position);
+
+    // Returns nullptr if the line wasn't generated from any source
+    [[nodiscard]] const Entry* find(uint32_t assemblyLine) const;
+    [[nodiscard]] std::string_view getFunctionName(int function) const;
+    // One line per entry: "<assembly line> <file>:<line> <function>"
+    [[nodiscard]] std::string toString() const;
+private:
+    std::vector<Entry> entries;
+    std::vector<std::string> functions;
+};
@@ -0,0 +1,59 @@
+#include "symboltable.hpp"
+
+SymbolID SymbolTable::intern(std::string_view name) {
+    if (const auto id = this->ids.find(name); id != this->ids.end())
+        return id->second;
+    const auto id = static_cast<SymbolID>(this->names.size());
+    this->ids.emplace(this->names.emplace_back(name), id);
+    this->bindings.emplace_back();
+    this->functions.push_back({id, -1});
+    return id;
+}
+
+std::string_view SymbolTable::getName(SymbolID id) const {
+    return this->names[id];
+}
+
+void SymbolTable::pushScope(bool isolated) {
+    if (isolated)
+        this->isolatedScopes.push_back(static_cast<int>(this->scopes.size()));
+    this->scopes.emplace_back();
+}
+
+void SymbolTable::popScope() {
+    for (const auto name : this->scopes.back())
+        this->bindings[name].pop_back();
+    this->scopes.pop_back();
+    if (!this->isolatedScopes.empty() && this->isolatedScopes.back() == this->scopes.size())
+        this->isolatedScopes.pop_back();
+}
+
+int SymbolTable::declareVariable(SymbolID name, int variable) {
+    const auto index = static_cast<int>(this->symbols.size());
+    this->symbols.push_back({name, variable, static_cast<int>(this->scopes.size()) - 1});
+    this->bindings[name].push_back(index);
+    this->scopes.back().push_back(name);
+    return index;
+}
+
+const Symbol* SymbolTable::findVariable(SymbolID name) const {
+    if (this->bindings[name].empty())
+        return nullptr;
+    const auto& symbol = this->symbols[this->bindings[name].back()];
+    // Variables outside the innermost isolated scope are hidden, older bindings are even further out
+    if (!this->isolatedScopes.empty() && symbol.scope < this->isolatedScopes.back())
+        return nullptr;
+    return &symbol;
+}
+
+Symbol& SymbolTable::getSymbol(int index) {
+    return this->symbols[index];
+}
+
+void SymbolTable::declareFunction(SymbolID name, int parameterCount) {
+    this->functions[name].parameterCount = parameterCount;
+}
+
+const FunctionSymbol* SymbolTable::findFunction(SymbolID name) const {
+    return this->functions[name].parameterCount >= 0 ? &this->functions[name] : nullptr;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Identifiers are interned once, everything else refers to them by id
+using SymbolID = int;
+
+struct Symbol {
+    SymbolID name = -1;
+    // Variable id within the IR function that declared it
+    int variable = -1;
+    int scope = 0;
+    // Filled in once the function has been allocated, a spilled variable has a stack slot instead of a register
+    int physicalRegister = -1;
+    int spillSlot = -1;
+};
+
+struct FunctionSymbol {
+    SymbolID name = -1;
+    int parameterCount = 0;
+};
+
+class SymbolTable {
+public:
+    // Returns the id of an identifier, adding it the first time it is seen
+    [[nodiscard]] SymbolID intern(std::string_view name);
+    [[nodiscard]] std::string_view getName(SymbolID id) const;
+
+    // Isolated scopes can't see variables declared outside of them, only functions
+    void pushScope(bool isolated);
+    void popScope();
+
+    // Returns the index of the new symbol
+    int declareVariable(SymbolID name, int variable);
+    // Returns the innermost visible variable with this name, or nullptr if there is none
+    [[nodiscard]] const Symbol* findVariable(SymbolID name) const;
+    [[nodiscard]] Symbol& getSymbol(int index);
+
+    void declareFunction(SymbolID name, int parameterCount);
+    [[nodiscard]] const FunctionSymbol* findFunction(SymbolID name) const;
+private:
+    // Deque so the views used as keys stay valid as it grows
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, SymbolID> ids;
+
+    std::vector<Symbol> symbols;
+    // Indices of the symbols bound to each name, innermost last
+    std::vector<std::vector<int>> bindings;
+    // Names declared by each open scope
+    std::vector<std::vector<SymbolID>> scopes;
+    // Depth of the innermost isolated scope
+    std::vector<int> isolatedScopes;
+
+    // Indexed by name, parameterCount is -1 if the name isn't a function
+    std::vector<FunctionSymbol> functions;
+};
@@ -1,20 +1,65 @@
 #pragma once
 
-#include <sstream>
+#include <charconv>
 #include <string>
+#include <string_view>
 #include <vector>
 
-std::vector<std::string> splitString(const std::string& input, char delimiter = ' ') {
-    std::stringstream ss{input};
-    std::vector<std::string> out;
-    std::string token;
-    while (std::getline(ss, token, delimiter))
-        out.push_back(token);
-    return out;
+// Appends views of each token to out, consecutive delimiters produce empty tokens but a trailing one doesn't
+inline void splitString(std::string_view input, std::vector<std::string_view>& out, char delimiter = ' ') {
+    for (std::size_t begin = 0; begin < input.size();) {
+        auto end = input.find(delimiter, begin);
+        if (end == std::string_view::npos)
+            end = input.size();
+        out.push_back(input.substr(begin, end - begin));
+        begin = end + 1;
+    }
+}
+
+// Strings are written as their length on its own line followed by the bytes, so they can hold anything
+
+inline void writeString(std::string& out, std::string_view value) {
+    out += std::to_string(value.size());
+    out += '\n';
+    out += value;
+}
+
+inline void writeStrings(std::string& out, const std::vector<std::string>& values) {
+    out += std::to_string(values.size());
+    out += '\n';
+    for (const auto& value : values)
+        writeString(out, value);
+}
+
+inline bool readNumber(std::string_view& in, std::size_t& number) {
+    const auto newline = in.find('\n');
+    if (newline == std::string_view::npos)
+        return false;
+    const auto [ptr, ec] = std::from_chars(in.data(), in.data() + newline, number);
+    if (ec != std::errc{} || ptr != in.data() + newline)
+        return false;
+    in.remove_prefix(newline + 1);
+    return true;
+}
+
+inline bool readString(std::string_view& in, std::string& value) {
+    std::size_t size;
+    if (!readNumber(in, size) || size > in.size())
+        return false;
+    value = in.substr(0, size);
+    in.remove_prefix(size);
+    return true;
 }
 
-void replaceSubstring(std::string& str, const std::string& substr, const std::string& replacement) {
-    for (auto found = str.find(substr); found != std::string::npos; found = str.find(substr)) {
-        str.replace(found, substr.length(), replacement);
+inline bool readStrings(std::string_view& in, std::vector<std::string>& values) {
+    std::size_t count;
+    // Every string takes up at least one byte, so a count any larger can only come from a broken or hostile message
+    if (!readNumber(in, count) || count > in.size())
+        return false;
+    values.resize(count);
+    for (auto& value : values) {
+        if (!readString(in, value))
+            return false;
     }
+    return true;
 }
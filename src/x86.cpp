@@ -0,0 +1,301 @@
+#include "x86.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <string_view>
+
+#include "lowering.hpp"
+
+#define X86_SYSCALL_WRITE 1
+#define X86_SYSCALL_EXIT 60
+
+namespace {
+
+// Where each AArch64 register lives. The allocator hands out the lowest registers first, so those get real registers
+// and the rest are kept in X86_REGISTER_FILE. rax, rcx, rdx and r11 are scratch, syscall clobbers rcx and r11 anyway
+constexpr const char* registerNames[] = {
+    "%rdi", "%rsi", nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, "%rbx", "%r12", "%r13", "%r14", "%r15", "%rbp",
+    "%r8", "%r9", "%r10", nullptr, nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, "%rsp",
+};
+
+bool isImmediate(std::string_view location) {
+    return location.starts_with('$');
+}
+
+bool isMemory(std::string_view location) {
+    return !location.starts_with('%') && !isImmediate(location);
+}
+
+bool fitsImmediate(int64_t value) {
+    return value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max();
+}
+
+class Translator {
+public:
+    Translator(FileWriter& writer_, std::vector<uint32_t>* lines_)
+            : writer(writer_)
+            , lines(lines_) {}
+
+    void translate(const MachineInstruction& instr);
+private:
+    FileWriter& writer;
+    std::vector<uint32_t>* lines;
+    // Source line of the instruction being translated
+    uint32_t line = 0;
+
+    void emit(std::string_view text) {
+        this->writer.beginLine() += text;
+        this->writer.endLine();
+        if (this->lines)
+            this->lines->push_back(this->line);
+    }
+    void emitLabel(std::string_view name) {
+        this->writer.dedent();
+        this->emit(std::string{name} + ':');
+        this->writer.indent();
+    }
+    // Copies src to dst, going through rax when neither of them is a register
+    void move(const std::string& dst, const std::string& src) {
+        if (dst == src)
+            return;
+        if (isMemory(dst) && isMemory(src)) {
+            this->emit("movq " + src + ", %rax");
+            this->emit("movq %rax, " + dst);
+            return;
+        }
+        this->emit("movq " + src + ", " + dst);
+    }
+    // dst = a op b, op only takes two operands so a is copied into the result first
+    void arithmetic(std::string_view op, const MachineOperand& dst, const MachineOperand& a, const MachineOperand& b) {
+        const auto d = this->getLocation(dst);
+        const auto second = this->getSource(b, "%rcx");
+        // imul can't write to memory, and the copy of a mustn't overwrite b before it is read
+        const auto result = !isMemory(d) && d != second ? d : std::string{"%rax"};
+        this->move(result, this->getSource(a, "%rax"));
+        this->emit(std::string{op} + ' ' + second + ", " + result);
+        this->move(d, result);
+    }
+    // dst = floor(a / b), matching the simulator
+    void divide(const MachineOperand& dst, const MachineOperand& a, const MachineOperand& b);
+    // Adjusts a base register by the offset of a pre or post index address
+    void adjustBase(const MachineOperand& address) {
+        const auto base = this->getLocation(MachineOperand::reg(address.base));
+        this->emit((address.value < 0 ? "subq $" : "addq $") + std::to_string(address.value < 0 ? -address.value : address.value) + ", " + base);
+    }
+    // Loads or stores each register in turn, 8 bytes apart
+    void transfer(const MachineInstruction& instr, bool load);
+
+    [[nodiscard]] static std::string getLocation(const MachineOperand& operand);
+    // Like getLocation, but immediates too big for an instruction are moved into scratch first
+    [[nodiscard]] std::string getSource(const MachineOperand& operand, const std::string& scratch);
+};
+
+void Translator::translate(const MachineInstruction& instr) {
+    this->line = instr.line;
+    const auto& operands = instr.operands;
+    switch (instr.mnemonic) {
+        case MNEMONIC_LABEL:
+            this->emitLabel(operands[0].name);
+            break;
+        case MNEMONIC_MOV:
+            if (operands[0].isRegister(8) && operands[1].type == OPERAND_IMMEDIATE) {
+                // x8 only ever holds the number of the next system call, which is different on x86-64
+                const auto number = operands[1].value == ASM_SYSCALL_WRITE ? X86_SYSCALL_WRITE : operands[1].value == ASM_SYSCALL_EXIT ? X86_SYSCALL_EXIT : operands[1].value;
+                this->move(getLocation(operands[0]), '$' + std::to_string(number));
+                break;
+            }
+            this->move(getLocation(operands[0]), this->getSource(operands[1], "%rax"));
+            break;
+        case MNEMONIC_ADD:
+            this->arithmetic("addq", operands[0], operands[1], operands[2]);
+            break;
+        case MNEMONIC_SUB:
+            this->arithmetic("subq", operands[0], operands[1], operands[2]);
+            break;
+        case MNEMONIC_MUL:
+            this->arithmetic("imulq", operands[0], operands[1], operands[2]);
+            break;
+        case MNEMONIC_SDIV:
+            this->divide(operands[0], operands[1], operands[2]);
+            break;
+        case MNEMONIC_MADD:
+        case MNEMONIC_MSUB: {
+            this->move("%rax", this->getSource(operands[1], "%rax"));
+            this->emit("imulq " + this->getSource(operands[2], "%rcx") + ", %rax");
+            if (instr.mnemonic == MNEMONIC_MADD) {
+                this->emit("addq " + this->getSource(operands[3], "%rcx") + ", %rax");
+                this->move(getLocation(operands[0]), "%rax");
+            } else {
+                this->move("%rcx", this->getSource(operands[3], "%rcx"));
+                this->emit("subq %rax, %rcx");
+                this->move(getLocation(operands[0]), "%rcx");
+            }
+            break;
+        }
+        case MNEMONIC_LSL:
+        case MNEMONIC_ASR: {
+            // x86-64 only looks at the low 6 bits of the shift, the simulator shifts everything out instead
+            const auto shift = operands[2].value;
+            if (instr.mnemonic == MNEMONIC_LSL && shift > 63)
+                this->move(getLocation(operands[0]), "$0");
+            else
+                this->arithmetic(instr.mnemonic == MNEMONIC_LSL ? "shlq" : "sarq", operands[0], operands[1], MachineOperand::imm(std::min<int64_t>(shift, 63)));
+            break;
+        }
+        case MNEMONIC_CMP: {
+            auto first = this->getSource(operands[0], "%rax");
+            const auto second = this->getSource(operands[1], "%rcx");
+            if (isImmediate(first) || (isMemory(first) && isMemory(second))) {
+                this->move("%rax", first);
+                first = "%rax";
+            }
+            this->emit("cmpq " + second + ", " + first);
+            break;
+        }
+        case MNEMONIC_CSEL: {
+            // cmov leaves the flags alone like csel does, but can't write to memory
+            static constexpr const char* moves[] = {"cmove ", "cmovne ", "cmovl ", "cmovle ", "cmovg ", "cmovge "};
+            this->move("%rax", getLocation(operands[2]));
+            this->emit(moves[operands[3].value - MNEMONIC_BEQ] + getLocation(operands[1]) + ", %rax");
+            this->move(getLocation(operands[0]), "%rax");
+            break;
+        }
+        case MNEMONIC_CBZ:
+        case MNEMONIC_CBNZ:
+            // Unlike cbz this sets the flags, which is fine since every csel and conditional branch has a cmp of its own
+            this->emit("cmpq $0, " + getLocation(operands[0]));
+            this->emit((instr.mnemonic == MNEMONIC_CBZ ? "je " : "jne ") + operands[1].name);
+            break;
+        case MNEMONIC_B:
+        case MNEMONIC_BEQ:
+        case MNEMONIC_BNE:
+        case MNEMONIC_BLT:
+        case MNEMONIC_BLE:
+        case MNEMONIC_BGT:
+        case MNEMONIC_BGE: {
+            static constexpr const char* jumps[] = {"jmp ", "je ", "jne ", "jl ", "jle ", "jg ", "jge "};
+            this->emit(jumps[instr.mnemonic - MNEMONIC_B] + operands[0].name);
+            break;
+        }
+        case MNEMONIC_BL:
+            this->emit("call " + operands[0].name);
+            break;
+        case MNEMONIC_RET:
+            this->emit("ret");
+            break;
+        case MNEMONIC_SVC:
+            // x0 and x1 already live in rdi and rsi. The simulator leaves x0 alone after a write, and so does the kernel with rdi
+            this->move("%rdx", getLocation(MachineOperand::reg(2)));
+            this->move("%rax", getLocation(MachineOperand::reg(8)));
+            this->emit("syscall");
+            break;
+        case MNEMONIC_LDR:
+        case MNEMONIC_LDP:
+            if (operands[0].isRegister(ASM_REGISTER_LR))
+                break;
+            if (operands[1].type == OPERAND_SYMBOL) {
+                this->move(getLocation(operands[0]), '$' + operands[1].name);
+                break;
+            }
+            this->transfer(instr, true);
+            break;
+        case MNEMONIC_STR:
+        case MNEMONIC_STP:
+            // call and ret keep the return address on the stack, so there is no link register to save
+            if (operands[0].isRegister(ASM_REGISTER_LR))
+                break;
+            this->transfer(instr, false);
+            break;
+        default:
+            // Raw asm is rejected by the parser, and pseudo instructions are expanded by the register allocator
+            break;
+    }
+}
+
+void Translator::divide(const MachineOperand& dst, const MachineOperand& a, const MachineOperand& b) {
+    // idiv can't take an immediate, and traps on the one quotient that doesn't fit
+    auto divisor = this->getSource(b, "%rcx");
+    if (isImmediate(divisor)) {
+        this->move("%rcx", divisor);
+        divisor = "%rcx";
+    }
+    this->move("%rax", this->getSource(a, "%rax"));
+    this->emit("cmpq $-1, " + divisor);
+    this->emit("jne 1f");
+    this->emit("negq %rax");
+    this->emit("jmp 2f");
+    this->emitLabel("1");
+    this->emit("cqto");
+    this->emit("idivq " + divisor);
+    // Round towards negative infinity when there is a remainder with the opposite sign to the divisor
+    this->emit("testq %rdx, %rdx");
+    this->emit("je 2f");
+    this->emit("xorq " + divisor + ", %rdx");
+    this->emit("jns 2f");
+    this->emit("decq %rax");
+    this->emitLabel("2");
+    this->move(getLocation(dst), "%rax");
+}
+
+void Translator::transfer(const MachineInstruction& instr, bool load) {
+    const auto& address = instr.operands.back();
+    if (address.mode == ADDRESS_PRE_INDEX)
+        this->adjustBase(address);
+    const auto base = getLocation(MachineOperand::reg(address.base));
+    for (int i = 0; i + 1 < instr.operands.size(); i++) {
+        const auto offset = (address.mode == ADDRESS_OFFSET ? address.value : 0) + i * 8;
+        const auto memory = (offset != 0 ? std::to_string(offset) : std::string{}) + '(' + base + ')';
+        const auto value = getLocation(instr.operands[i]);
+        if (load)
+            this->move(value, memory);
+        else
+            this->move(memory, value);
+    }
+    if (address.mode == ADDRESS_POST_INDEX)
+        this->adjustBase(address);
+}
+
+std::string Translator::getLocation(const MachineOperand& operand) {
+    switch (operand.type) {
+        case OPERAND_REGISTER:
+            if (const auto* name = registerNames[operand.value])
+                return name;
+            return X86_REGISTER_FILE "+" + std::to_string(operand.value * 8) + "(%rip)";
+        case OPERAND_IMMEDIATE:
+            return '$' + std::to_string(operand.value);
+        case OPERAND_LABEL:
+        case OPERAND_SYMBOL:
+            return '$' + operand.name;
+        default:
+            // Memory operands are only ever used by loads and stores
+            return {};
+    }
+}
+
+std::string Translator::getSource(const MachineOperand& operand, const std::string& scratch) {
+    if (operand.type != OPERAND_IMMEDIATE || fitsImmediate(operand.value))
+        return getLocation(operand);
+    this->emit("movabsq $" + std::to_string(operand.value) + ", " + scratch);
+    return scratch;
+}
+
+} // namespace
+
+void writeX86Instructions(FileWriter& writer, const std::vector<MachineInstruction>& code, std::vector<uint32_t>* lines) {
+    // Most instructions turn into one or two lines
+    writer.reserve(code.size() * ASM_AVERAGE_LINE_LENGTH * 2);
+    Translator translator{writer, lines};
+    for (const auto& instr : code)
+        translator.translate(instr);
+}
+
+void writeX86Exit(FileWriter& writer) {
+    writer << "movq $" + std::to_string(X86_SYSCALL_EXIT) + ", %rax" << "syscall";
+}
+
+void writeX86RegisterFile(FileWriter& writer) {
+    writer << ".bss" << X86_REGISTER_FILE ": .zero " + std::to_string(ASM_REGISTER_SP * 8);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "filewriter.hpp"
+#include "instruction.hpp"
+
+// Holds the AArch64 registers x86-64 has no room for
+#define X86_REGISTER_FILE ".Larmcomp_registers"
+
+// Writes AArch64 code that has been through register allocation as GNU as x86-64 assembly in AT&T syntax.
+// The source line of every line written is appended to lines, if given
+void writeX86Instructions(FileWriter& writer, const std::vector<MachineInstruction>& code, std::vector<uint32_t>* lines = nullptr);
+
+// Exits with the value in x0, which is what the simulator does once it runs off the end of the code
+void writeX86Exit(FileWriter& writer);
+
+// Reserves the memory behind X86_REGISTER_FILE
+void writeX86RegisterFile(FileWriter& writer);
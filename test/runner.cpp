@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parser.hpp"
+#include "simulator.hpp"
+#include "utilities.hpp"
+
+#if __has_include(<sys/wait.h>)
+#include <sys/wait.h>
+#define RUNNER_HAS_NATIVE
+#endif
+
+// Programs without a budget still have to finish eventually
+#define RUNNER_DEFAULT_INSTRUCTION_LIMIT 100000000
+
+// The corpus directory is searched for programs with this extension. Each one can have these files next to it,
+// ones that don't exist aren't checked:
+//   <name>.stdin           fed to the program
+//   <name>.stdout          everything the program prints
+//   <name>.exit            its exit code
+//   <name>.error           what it stops with instead of exiting, up to the first colon. Natively the program only has
+//                          to stop abnormally, a program that stops with an error fails without this file
+//   <name>.O<n>.registers  the register dump once it has run, which depends on the optimization level
+//   <name>.O<n>.budget     the most instructions it may execute at that optimization level
+#define RUNNER_SOURCE_EXTENSION ".arm"
+
+// Part of the error given for asm blocks when compiling for x86-64, those programs are skipped when running natively
+#define RUNNER_ASM_ERROR "asm blocks can only be compiled for AArch64"
+
+namespace {
+
+struct RunnerOptions {
+    std::string directory = ARMCOMP_SOURCE_DIR "/test/corpus";
+    int optimizationLevel = 1;
+    // 0 uses one worker per core
+    int jobs = 0;
+    // Writes what every program did as what it is expected to do, instead of checking it
+    bool update = false;
+    // Builds every program for x86-64 with as and ld and runs it on this machine instead of in the simulator. Only what
+    // it prints and its exit code are checked, those have to be the same on every target
+    bool native = false;
+};
+
+struct RunResult {
+    std::string output;
+    int exitCode = 0;
+    std::string registers;
+    uint64_t executedCount = 0;
+    // Set if the program stopped with an error instead of exiting, without the details after the first colon
+    std::string error;
+};
+
+bool readFile(const std::filesystem::path& path, std::string& contents) {
+    std::ifstream file{path, std::ios::in | std::ios::binary};
+    if (!file.is_open())
+        return false;
+    contents.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+    return true;
+}
+
+bool writeFile(const std::filesystem::path& path, std::string_view contents) {
+    std::ofstream file{path, std::ios::out | std::ios::binary | std::ios::trunc};
+    file.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    return static_cast<bool>(file);
+}
+
+// Reads a file holding a single number, surrounding whitespace is ignored
+template<typename T>
+bool readNumberFile(const std::filesystem::path& path, T& number) {
+    std::string contents;
+    if (!readFile(path, contents))
+        return false;
+    const auto* begin = contents.data();
+    const auto* end = begin + contents.size();
+    while (begin < end && std::isspace(static_cast<unsigned char>(*begin)))
+        begin++;
+    while (end > begin && std::isspace(static_cast<unsigned char>(*(end - 1))))
+        end--;
+    const auto [ptr, ec] = std::from_chars(begin, end, number);
+    return ec == std::errc{} && ptr == end;
+}
+
+std::filesystem::path getLevelPath(const std::filesystem::path& program, int optimizationLevel, std::string_view extension) {
+    auto path = program;
+    return path.replace_extension(".O" + std::to_string(optimizationLevel) + std::string{extension});
+}
+
+// Compiles and simulates a program, returns an error if either fails
+std::string runProgram(const std::filesystem::path& program, int optimizationLevel, uint64_t instructionLimit, RunResult& result) {
+    Parser parser{program.string(), {.optimizationLevel = optimizationLevel}};
+    if (auto error = parser.parse(); !error.empty())
+        return "failed to compile: " + error;
+
+    std::string input;
+    (void) readFile(std::filesystem::path{program}.replace_extension(".stdin"), input);
+    std::istringstream inputStream{input};
+    std::ostringstream outputStream;
+    Simulator simulator{outputStream, inputStream};
+    simulator.setInstructionLimit(instructionLimit);
+    if (auto error = simulator.load(parser.getAssembly()); !error.empty())
+        return "failed to load: " + error;
+    const auto error = simulator.run();
+    result.executedCount = simulator.getExecutedCount();
+    // Running out of instructions is the runner stopping the program, not the program stopping itself
+    if (result.executedCount > instructionLimit)
+        return "failed to run: " + error;
+    result.error = error.substr(0, error.find(':'));
+    result.output = outputStream.str();
+    result.exitCode = simulator.getExitCode();
+    result.registers = simulator.getRegisterDump();
+    return "";
+}
+
+std::string quotePath(const std::filesystem::path& path) {
+    return '"' + path.string() + '"';
+}
+
+// Builds a program for x86-64 and runs it on this machine, returns an error if any step fails
+std::string runNativeProgram(const std::filesystem::path& program, int optimizationLevel, RunResult& result) {
+#ifdef RUNNER_HAS_NATIVE
+    Parser parser{program.string(), ParserOptions{.optimizationLevel = optimizationLevel, .target = TARGET_X86_64}};
+    if (auto error = parser.parse(); !error.empty())
+        return "failed to compile: " + error;
+
+    // Every program and level gets files of its own, so the workers don't overwrite each other's
+    const auto base = std::filesystem::temp_directory_path() / ("armcomp_test_" + program.stem().string() + "_O" + std::to_string(optimizationLevel));
+    auto assembly = base, object = base, output = base;
+    assembly.replace_extension(".s");
+    object.replace_extension(".o");
+    output.replace_extension(".stdout");
+    const auto removeFiles = [&] {
+        std::error_code ignored;
+        for (const auto& path : {assembly, object, base, output})
+            std::filesystem::remove(path, ignored);
+    };
+    if (!writeFile(assembly, parser.getAssembly()))
+        return "could not write " + assembly.string();
+    if (std::system(("as " + quotePath(assembly) + " -o " + quotePath(object) + " && ld " + quotePath(object) + " -o " + quotePath(base)).c_str()) != 0) {
+        removeFiles();
+        return "failed to assemble and link " + assembly.string();
+    }
+
+    auto input = program;
+    input.replace_extension(".stdin");
+    // exec replaces the shell, otherwise a program killed by a signal would look like it exited with 128 + the signal
+    const auto command = "exec " + quotePath(base) + " < " + (std::filesystem::exists(input) ? quotePath(input) : "/dev/null") + " > " + quotePath(output);
+    const int status = std::system(command.c_str());
+    const bool read = readFile(output, result.output);
+    removeFiles();
+    if (!read)
+        return "could not read what it printed";
+    if (WIFEXITED(status))
+        result.exitCode = WEXITSTATUS(status);
+    else
+        result.error = "did not exit normally";
+    return "";
+#else
+    return "programs can't be run natively on this platform";
+#endif
+}
+
+// Points out the first line that differs, which is usually enough to see what went wrong
+void writeDifference(std::ostream& report, std::string_view what, std::string_view expected, std::string_view actual) {
+    std::vector<std::string_view> expectedLines, actualLines;
+    splitString(expected, expectedLines, '\n');
+    splitString(actual, actualLines, '\n');
+    std::size_t line = 0;
+    while (line < expectedLines.size() && line < actualLines.size() && expectedLines[line] == actualLines[line])
+        line++;
+    const auto getLine = [line](const std::vector<std::string_view>& lines) {
+        return line < lines.size() ? '"' + std::string{lines[line]} + '"' : std::string{"<end>"};
+    };
+    report << "    " << what << " differs at line " << line + 1 << ", expected " << getLine(expectedLines) << " but got " << getLine(actualLines) << '\n';
+}
+
+// Checks a program against what it is expected to do, returns false if it doesn't do it
+bool checkProgram(const std::filesystem::path& program, const RunnerOptions& options, std::ostream& report) {
+    const auto name = program.stem().string();
+    const auto budgetPath = getLevelPath(program, options.optimizationLevel, ".budget");
+    uint64_t budget = 0;
+    const bool hasBudget = !options.update && !options.native && readNumberFile(budgetPath, budget);
+
+    RunResult result;
+    auto error = options.native
+            ? runNativeProgram(program, options.optimizationLevel, result)
+            : runProgram(program, options.optimizationLevel, hasBudget ? budget : RUNNER_DEFAULT_INSTRUCTION_LIMIT, result);
+    if (options.native && error.find(RUNNER_ASM_ERROR) != std::string::npos) {
+        report << "skip " << name << " (asm blocks are AArch64 only)\n";
+        return true;
+    }
+    if (!error.empty()) {
+        if (hasBudget && result.executedCount > budget)
+            error = "executed more than its budget of " + std::to_string(budget) + " instructions";
+        report << "FAIL " << name << "\n    " << error << '\n';
+        return false;
+    }
+
+    auto stdoutPath = program, exitPath = program, errorPath = program;
+    stdoutPath.replace_extension(".stdout");
+    exitPath.replace_extension(".exit");
+    errorPath.replace_extension(".error");
+    const auto registersPath = getLevelPath(program, options.optimizationLevel, ".registers");
+    if (options.update) {
+        // A program has either an exit code or an error
+        std::error_code ignored;
+        std::filesystem::remove(result.error.empty() ? errorPath : exitPath, ignored);
+        const bool written = writeFile(stdoutPath, result.output)
+                && (result.error.empty() ? writeFile(exitPath, std::to_string(result.exitCode) + '\n') : writeFile(errorPath, result.error + '\n'))
+                && writeFile(registersPath, result.registers)
+                && writeFile(budgetPath, std::to_string(result.executedCount) + '\n');
+        report << (written ? "updated " : "FAIL ") << name << " (" << result.executedCount << " instructions)\n";
+        if (!written)
+            report << "    could not write its expected results\n";
+        return written;
+    }
+
+    std::ostringstream failures;
+    std::string expectedError;
+    if (readFile(errorPath, expectedError)) {
+        while (!expectedError.empty() && std::isspace(static_cast<unsigned char>(expectedError.back())))
+            expectedError.pop_back();
+        if (result.error.empty())
+            failures << "    exited with " << result.exitCode << " instead of stopping with \"" << expectedError << "\"\n";
+        else if (!options.native && result.error != expectedError)
+            failures << "    stopped with \"" << result.error << "\" instead of \"" << expectedError << "\"\n";
+    } else if (!result.error.empty()) {
+        failures << "    stopped with \"" << result.error << "\" instead of exiting\n";
+    }
+    if (std::string expected; readFile(stdoutPath, expected) && expected != result.output)
+        writeDifference(failures, "stdout", expected, result.output);
+    if (int expected; result.error.empty() && readNumberFile(exitPath, expected) && expected != result.exitCode)
+        failures << "    exited with " << result.exitCode << " instead of " << expected << '\n';
+    // Registers are simulator state, they aren't the same natively
+    if (std::string expected; !options.native && readFile(registersPath, expected) && expected != result.registers)
+        writeDifference(failures, "register dump", expected, result.registers);
+
+    if (!failures.str().empty()) {
+        report << "FAIL " << name << '\n' << failures.str();
+        return false;
+    }
+    if (options.native) {
+        report << "ok   " << name << " (native)\n";
+        return true;
+    }
+    report << "ok   " << name << " (" << result.executedCount;
+    if (hasBudget)
+        report << '/' << budget;
+    report << " instructions)\n";
+    return true;
+}
+
+// Runs every program on a pool of workers, returns 1 if any of them failed
+int runCorpus(const std::vector<std::filesystem::path>& programs, const RunnerOptions& options) {
+    const auto cores = static_cast<int>(std::thread::hardware_concurrency());
+    const int workerCount = std::clamp(options.jobs > 0 ? options.jobs : cores, 1, static_cast<int>(programs.size()));
+    std::cout << (options.update ? "Updating " : "Running ") << programs.size() << " programs at -O" << options.optimizationLevel << (options.native ? " natively" : "") << " with " << workerCount << " workers...\n";
+
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<std::size_t> next = 0;
+    std::atomic<int> failed = 0;
+    std::mutex outputMutex;
+    const auto work = [&] {
+        for (auto i = next++; i < programs.size(); i = next++) {
+            // Reports are buffered so the lines of each program stay together
+            std::ostringstream report;
+            if (!checkProgram(programs[i], options, report))
+                failed++;
+            std::lock_guard lock{outputMutex};
+            std::cout << report.str();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < workerCount; i++)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+
+    const auto milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::fixed << std::setprecision(2) << "Passed " << programs.size() - failed << '/' << programs.size() << " programs in " << milliseconds << " ms\n";
+    return failed > 0 ? 1 : 0;
+}
+
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    RunnerOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.starts_with("-O") && arg.length() == 3 && std::isdigit(arg[2])) {
+            options.optimizationLevel = arg[2] - '0';
+        } else if (arg.starts_with("-j") && arg.length() > 2 && std::all_of(arg.begin() + 2, arg.end(), [](char c) { return std::isdigit(c); })) {
+            options.jobs = std::stoi(arg.substr(2));
+        } else if (arg == "--update") {
+            options.update = true;
+        } else if (arg == "--target=x86_64-linux") {
+            options.native = true;
+        } else if (arg.starts_with('-')) {
+            std::cout << "Unknown option \"" << arg << "\"\n";
+            return 1;
+        } else {
+            options.directory = arg;
+        }
+    }
+
+    if (options.update && options.native) {
+        std::cout << "Expected results can only be updated from the simulator\n";
+        return 1;
+    }
+
+    // Sorted so the corpus always runs in the same order
+    std::vector<std::filesystem::path> programs;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator{options.directory, error}) {
+        if (entry.is_regular_file() && entry.path().extension() == RUNNER_SOURCE_EXTENSION)
+            programs.push_back(entry.path());
+    }
+    std::sort(programs.begin(), programs.end());
+    if (programs.empty()) {
+        std::cout << "No programs found in \"" << options.directory << "\"\n";
+        return 1;
+    }
+    return runCorpus(programs, options);
+}